@@ -1,16 +1,31 @@
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <numeric>
+#include <queue>
 #include <vector>
 
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QStandardPaths>
 #include <QtGui/QKeyEvent>
 
 #include <OpenMesh/Core/IO/MeshIO.hh>
 #include <OpenMesh/Core/IO/writer/STLWriter.hh>
 #include <OpenMesh/Tools/Smoother/JacobiLaplaceSmootherT.hh>
 
+#include "Eigen/Core"
+
 #ifdef BETTER_MEAN_CURVATURE
 #include "Eigen/Eigenvalues"
 #include "Eigen/Geometry"
@@ -22,6 +37,14 @@
 #include "jet-wrapper.h"
 #endif
 
+#ifdef USE_OFFSCREEN
+#include "offscreen-context.h"
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "MyViewer.h"
 
 #ifdef _WIN32
@@ -31,22 +54,44 @@
 
 #include <QDebug>
 
+// OpenGL calls for both precisions of the mesh
+static inline void glVertex(const OpenMesh::Vec3d &p) { glVertex3dv(p.data()); }
+static inline void glVertex(const OpenMesh::Vec3f &p) { glVertex3fv(p.data()); }
+static inline void glNormal(const OpenMesh::Vec3d &n) { glNormal3dv(n.data()); }
+static inline void glNormal(const OpenMesh::Vec3f &n) { glNormal3fv(n.data()); }
+
 MyViewer::MyViewer(QWidget *parent) :
-    QGLViewer(parent), model_type(ModelType::NONE),
+    QGLViewer(parent), model_type(ModelType::NONE), grid_resolution(0),
+    adaptive_tessellation(true), dragging(false), tessellation_tolerance(1.0e-3),
+    topology_changed(true), height_field_resolution(0), asynchronous(true), busy(false), cancel_requested(false),
     mean_min(0.0), mean_max(0.0), cutoff_ratio(0.05),
     show_control_points(true), show_solid(true), show_wireframe(false),
     visualization(Visualization::PLAIN), slicing_dir(0, 0, 1), slicing_scaling(1),
     last_filename(""),
     gridDensity(4.0), angleLimit(degToRad(60)), diameterCoefficient(0.07)/* should be 0.0015 as per Vanek (2014)*/, showWhereSupportNeeded(false), showAllPoints(false), showCones(false), showTree(false)
 {
+    bezier_basis.resolution = 0;
     setSelectRegionWidth(10);
     setSelectRegionHeight(10);
     axes.shown = false;
+    selected_vertex = -1;
+    selected_support = -1;
 
     supportMesh.request_face_normals(); supportMesh.request_halfedge_normals(); supportMesh.request_vertex_normals();
+    // Struts of edited branches are deleted in place
+    supportMesh.request_face_status(); supportMesh.request_edge_status();
+    supportMesh.request_halfedge_status(); supportMesh.request_vertex_status();
 }
 
 MyViewer::~MyViewer() {
+    // A background job may still use the viewer
+    cancel_requested = true;
+    running.waitForFinished();
+#ifdef USE_OFFSCREEN
+    // The textures belong to the offscreen context, when there is one
+    if (offscreen && !offscreen->makeCurrent())
+        return;
+#endif
     glDeleteTextures(1, &isophote_texture);
     glDeleteTextures(1, &environment_texture);
     glDeleteTextures(1, &slicing_texture);
@@ -140,12 +185,13 @@ void MyViewer::updateMeanCurvature() {
 
     // Compute mean values using dihedral angles
     for (auto v : mesh.vertices()) {
+        double mean = 0.0;
         for (auto h : mesh.vih_range(v)) {
             auto vec = mesh.calc_edge_vector(h);
             double angle = mesh.calc_dihedral_angle(h); // signed; returns 0 at the boundary
-            mesh.data(v).mean += angle * vec.norm();
+            mean += angle * vec.norm();
         }
-        mesh.data(v).mean *= 0.25 / vertex_area[v];
+        mesh.data(v).mean = mean * 0.25 / vertex_area[v];
     }
 }
 #else // BETTER_MEAN_CURVATURE
@@ -168,14 +214,14 @@ void MyViewer::updateMeanCurvature() {
         auto h0 = mesh.halfedge_handle(f);
         auto h1 = mesh.next_halfedge_handle(h0);
         auto h2 = mesh.next_halfedge_handle(h1);
-        auto e0 = mesh.calc_edge_vector(h0);
-        auto e1 = mesh.calc_edge_vector(h1);
-        auto e2 = mesh.calc_edge_vector(h2);
-        auto n0 = mesh.normal(mesh.to_vertex_handle(h1));
-        auto n1 = mesh.normal(mesh.to_vertex_handle(h2));
-        auto n2 = mesh.normal(mesh.to_vertex_handle(h0));
-
-        Vector n = mesh.normal(f), u, v;
+        Vector e0(mesh.calc_edge_vector(h0));
+        Vector e1(mesh.calc_edge_vector(h1));
+        Vector e2(mesh.calc_edge_vector(h2));
+        Vector n0(mesh.normal(mesh.to_vertex_handle(h1)));
+        Vector n1(mesh.normal(mesh.to_vertex_handle(h2)));
+        Vector n2(mesh.normal(mesh.to_vertex_handle(h0)));
+
+        Vector n(mesh.normal(f)), u, v;
         localSystem(n, u, v);
 
         // Solve a LSQ equation for (e,f,g) of the face
@@ -203,7 +249,7 @@ void MyViewer::updateMeanCurvature() {
             auto p = mesh.to_vertex_handle(h);
 
             // Rotate the (up,vp) local coordinate system to be coplanar with that of the face
-            Vector np = mesh.normal(p), up, vp;
+            Vector np(mesh.normal(p)), up, vp;
             localSystem(np, up, vp);
             auto axis = (np % n).normalize();
             double angle = std::acos(std::min(std::max(n | np, -1.0), 1.0));
@@ -274,37 +320,192 @@ Vec MyViewer::meanMapColor(double d) const {
 }
 
 void MyViewer::fairMesh() {
-    if (model_type != ModelType::MESH)
+    if (model_type != ModelType::MESH || isBusy())
+        return;
+
+    // Smooth a copy, and replace the points when done
+    auto faired = std::make_shared<MyMesh>(mesh);
+    runAsync(tr("Fairing mesh..."), [this, faired]() -> Publish {
+        OpenMesh::Smoother::JacobiLaplaceSmootherT<MyMesh> smoother(*faired);
+        smoother.initialize(OpenMesh::Smoother::SmootherT<MyMesh>::Normal, // or: Tangential_and_Normal
+                            OpenMesh::Smoother::SmootherT<MyMesh>::C1);
+        for (size_t i = 1; i <= 10; ++i) {
+            if (cancel_requested)
+                return nullptr;
+            smoother.smooth(10);
+            reportProgress(i * 10);
+        }
+        return [this, faired]() {
+            for (auto v : mesh.vertices())
+                mesh.set_point(v, faired->point(v));
+            fairing.reset(); // its weights are for the old geometry
+            updateMesh(false);
+        };
+    });
+}
+
+void MyViewer::fairMeshImplicit() {
+    if (model_type != ModelType::MESH || isBusy())
         return;
 
-    emit startComputation(tr("Fairing mesh..."));
-    OpenMesh::Smoother::JacobiLaplaceSmootherT<MyMesh> smoother(mesh);
-    smoother.initialize(OpenMesh::Smoother::SmootherT<MyMesh>::Normal, // or: Tangential_and_Normal
-                        OpenMesh::Smoother::SmootherT<MyMesh>::C1);
-    for (size_t i = 1; i <= 10; ++i) {
-        smoother.smooth(10);
-        emit midComputation(i * 10);
+    size_t n = mesh.n_vertices();
+    auto points = std::make_shared<ImplicitFairing::PointVector>(n);
+    std::vector<bool> fixed(n);
+    for (auto v : mesh.vertices()) {
+        (*points)[v.idx()] = Vector(mesh.point(v));
+        fixed[v.idx()] = mesh.is_boundary(v) || v.idx() == selected_vertex;
+    }
+
+    std::vector<size_t> triangles;
+    double time = 0.0;
+    if (!fairing || !fairing->compatible(n, fixed)) {
+        fairing.reset();
+        triangles.reserve(3 * mesh.n_faces());
+        for (auto f : mesh.faces())
+            for (auto v : mesh.fv_range(f))
+                triangles.push_back(v.idx());
+        // Diffusion time, in squared mean edge lengths
+        double sqr_length = 0.0;
+        for (auto e : mesh.edges())
+            sqr_length += mesh.calc_edge_sqr_length(e);
+        time = 25.0 * sqr_length / std::max<size_t>(mesh.n_edges(), 1);
+    }
+
+    runAsync(tr("Fairing mesh..."), [this, points, fixed, triangles, time]() -> Publish {
+        if (!fairing)
+            fairing = std::make_unique<ImplicitFairing::Solver>(*points, triangles, fixed, time);
+        reportProgress(50);
+        if (!fairing->isValid()) {
+            fairing.reset(); // tried again next time
+            return nullptr;
+        }
+        if (cancel_requested)
+            return nullptr;
+        for (size_t i = 1; i <= 2; ++i) {
+            (*fairing)(*points);
+            reportProgress(50 + i * 25);
+        }
+        return [this, points]() {
+            for (auto v : mesh.vertices())
+                mesh.set_point(v, MyMesh::Point((*points)[v.idx()]));
+            updateMesh(false);
+        };
+    });
+}
+
+void MyViewer::rotateModel(const Vector &up) {
+    // Around the center of the bounding box
+    Vector box_min, box_max;
+    box_min = box_max = Vector(mesh.point(*mesh.vertices_begin()));
+    for (auto v : mesh.vertices()) {
+        box_min.minimize(Vector(mesh.point(v)));
+        box_max.maximize(Vector(mesh.point(v)));
     }
+    Vector center = (box_min + box_max) / 2;
+    auto turn = [&](const Vector &p) { return Orientation::rotate(up, p - center) + center; };
+    if (model_type == ModelType::BEZIER_SURFACE)
+        for (auto &p : control_points)
+            p = Vec(turn(Vector(p[0], p[1], p[2])).data());
+    else
+        for (auto v : mesh.vertices())
+            mesh.set_point(v, MyMesh::Point(turn(Vector(mesh.point(v)))));
+    // Supports of the old orientation are useless
+    supportTree.clear();
+    supportMesh.clear();
+    strutFaces.clear();
     updateMesh(false);
-    emit endComputation();
 }
 
-#ifdef USE_JET_FITTING
+void MyViewer::runAsync(const QString &message, std::function<Publish()> job) {
+    // The job runs on a worker thread, and must not touch what the GUI thread draws;
+    // its results are published by the returned function, called on the GUI thread
+    // (unless the computation was cancelled, or nothing is returned)
+    cancel_requested = false;
+    progress_timer.start();
+    emit startComputation(message);
+    if (!asynchronous) {
+        auto publish = job();
+        if (publish && !cancel_requested)
+            publish();
+        emit endComputation();
+        update();
+        return;
+    }
+    busy = true;
+    auto watcher = new QFutureWatcher<Publish>(this);
+    connect(watcher, &QFutureWatcher<Publish>::finished, this, [this, watcher]() {
+        auto publish = watcher->result();
+        watcher->deleteLater();
+        busy = false;
+        if (publish && !cancel_requested)
+            publish();
+        emit endComputation();
+        update();
+    });
+    running = QtConcurrent::run(job);
+    watcher->setFuture(running);
+}
 
-void MyViewer::updateWithJetFit(size_t neighbors) {
-    std::vector<Vector> points;
-    for (auto v : mesh.vertices())
-        points.push_back(mesh.point(v));
+void MyViewer::reportProgress(int percent) {
+    // Throttled, so that tight loops can call it on every iteration
+    if (progress_timer.elapsed() < 100)
+        return;
+    progress_timer.restart();
+    emit midComputation(percent);
+}
 
-    auto nearest = JetWrapper::Nearest(points, neighbors);
+void MyViewer::cancelComputation() {
+    cancel_requested = true;
+}
+
+#ifdef USE_JET_FITTING
+
+void MyViewer::updateWithJetFit(size_t neighbors, double radius) {
+    size_t n = mesh.n_vertices();
+    std::vector<size_t> moved;
+    if (jet_nearest && jet_points.size() == n)
+        for (auto v : mesh.vertices())
+            if (jet_points[v.idx()] != Vector(mesh.point(v)))
+                moved.push_back(v.idx());
+
+    if (!jet_nearest || jet_points.size() != n || moved.size() > n / 10) {
+        jet_points.clear();
+        jet_points.reserve(n);
+        for (auto v : mesh.vertices())
+            jet_points.push_back(Vector(mesh.point(v)));
+        jet_nearest = std::make_unique<JetWrapper::Nearest>(jet_points, neighbors, radius);
+        jets = JetWrapper::fit(jet_points, *jet_nearest, 2);
+    } else if (!moved.empty()) {
+        // A jet changes only when a moved point was, or becomes, one of its samples,
+        // and the samples are never farther than the largest sampling radius
+        double r = 0;
+        for (const auto &jet : jets)
+            r = std::max(r, jet.radius);
+        std::vector<size_t> affected = moved;
+        for (auto i : moved)
+            jet_nearest->within(jet_points[i], r, affected);
+        for (auto i : moved) {
+            jet_points[i] = Vector(mesh.point(MyMesh::VertexHandle(i)));
+            jet_nearest->update(i);
+        }
+        for (auto i : moved)
+            jet_nearest->within(jet_points[i], r, affected);
+        std::sort(affected.begin(), affected.end());
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+        JetWrapper::fit(jet_points, affected, *jet_nearest, jets, 2);
+    }
 
     for (auto v : mesh.vertices()) {
-        auto jet = JetWrapper::fit(mesh.point(v), nearest, 2);
-        if ((mesh.normal(v) | jet.normal) < 0) {
-            mesh.set_normal(v, -jet.normal);
+        const auto &jet = jets[v.idx()];
+        if (!jet.valid) {
+            mesh.data(v).mean = 0; // keeps the normal of the mesh
+            continue;
+        }
+        if ((Vector(mesh.normal(v)) | jet.normal) < 0) {
+            mesh.set_normal(v, MyMesh::Normal(-jet.normal));
             mesh.data(v).mean = (jet.k_min + jet.k_max) / 2;
         } else {
-            mesh.set_normal(v, jet.normal);
+            mesh.set_normal(v, MyMesh::Normal(jet.normal));
             mesh.data(v).mean = -(jet.k_min + jet.k_max) / 2;
         }
     }
@@ -312,51 +513,103 @@ void MyViewer::updateWithJetFit(size_t neighbors) {
 
 #endif // USE_JET_FITTING
 
+void MyViewer::updateTopology() {
+    if (!topology_changed)
+        return;
+    auto &t = topology;
+    size_t n = mesh.n_vertices();
+    t.faces.clear();
+    t.faces.reserve(3 * mesh.n_faces());
+    for (auto f : mesh.faces())
+        for (auto v : mesh.fv_range(f))
+            t.faces.push_back(v.idx());
+    t.offsets.assign(n + 1, 0);
+    for (auto v : t.faces)
+        ++t.offsets[v+1];
+    std::partial_sum(t.offsets.begin(), t.offsets.end(), t.offsets.begin());
+    t.corners.resize(t.faces.size());
+    std::vector<int> next(t.offsets.begin(), t.offsets.end() - 1);
+    for (size_t c = 0; c < t.faces.size(); ++c)
+        t.corners[next[t.faces[c]]++] = c;
+    topology_changed = false;
+}
+
 void MyViewer::updateVertexNormals() {
     // Weights according to:
     //   N. Max, Weights for computing vertex normals from facet normals.
     //     Journal of Graphics Tools, Vol. 4(2), 1999.
-    for (auto v : mesh.vertices()) {
-        Vector n(0.0, 0.0, 0.0);
-        for (auto h : mesh.vih_range(v)) {
-            if (mesh.is_boundary(h))
-                continue;
-            auto in_vec  = mesh.calc_edge_vector(h);
-            auto out_vec = mesh.calc_edge_vector(mesh.next_halfedge_handle(h));
+    updateTopology();
+    const auto &t = topology;
+    const auto *points = mesh.points();
+    long n = mesh.n_vertices(); // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i) {
+        Vector normal(0.0, 0.0, 0.0);
+        for (int j = t.offsets[i]; j < t.offsets[i+1]; ++j) {
+            int c = t.corners[j], f = c - c % 3;
+            Vector p(points[i]), prev(points[t.faces[f + (c + 2) % 3]]), next(points[t.faces[f + (c + 1) % 3]]);
+            auto in_vec  = p - prev;
+            auto out_vec = next - p;
             double w = in_vec.sqrnorm() * out_vec.sqrnorm();
-            n += (in_vec % out_vec) / (w == 0.0 ? 1.0 : w);
+            normal += (in_vec % out_vec) / (w == 0.0 ? 1.0 : w);
         }
-        double len = n.length();
+        double len = normal.length();
         if (len != 0.0)
-            n /= len;
-        mesh.set_normal(v, n);
+            normal /= len;
+        mesh.set_normal(MyMesh::VertexHandle(i), MyMesh::Normal(normal));
     }
 }
 
 void MyViewer::updateMesh(bool update_mean_range) {
-    if (model_type == ModelType::BEZIER_SURFACE)
-        generateMesh(50);
     mesh.request_face_normals(); mesh.request_halfedge_normals(); mesh.request_vertex_normals();
-    mesh.update_face_normals(); mesh.update_halfedge_normals(); mesh.update_vertex_normals();
+    if (model_type == ModelType::BEZIER_SURFACE) {
+        // Normals and mean curvature are evaluated exactly, along with the points
+        if (adaptive_tessellation && !dragging)
+            generateAdaptiveMesh(tessellation_tolerance * controlNetSize());
+        else
+            generateMesh(50);
+        mesh.update_halfedge_normals();
+    } else {
+        mesh.update_face_normals(); mesh.update_halfedge_normals();
+        updateVertexNormals();
 #ifdef USE_JET_FITTING
-    mesh.update_vertex_normals();
-    updateWithJetFit(20);
+        updateWithJetFit(20); // oriented by the normals above
 #else // !USE_JET_FITTING
-    updateVertexNormals();
-    updateMeanCurvature();
+        updateMeanCurvature();
 #endif
+    }
+    finishMeshUpdate(update_mean_range);
+}
+
+// What depends on the normals and the curvature
+void MyViewer::finishMeshUpdate(bool update_mean_range) {
     if (update_mean_range)
         updateMeanMinMax();
+    updateTopology();
+    if (dragging)
+        return; // the analysis is only made for the final position, in mouseReleaseEvent
+    snapshot = std::make_shared<const MeshSnapshot<Scalar>>(mesh.points(), mesh.n_vertices(),
+                                                            topology.faces, mesh.face_normals());
+    height_field = std::make_shared<const HeightField>(*snapshot, height_field_resolution);
+}
+
+void MyViewer::boundingBox(Vector &box_min, Vector &box_max, bool with_supports) const {
+    box_min = box_max = Vector(mesh.point(*mesh.vertices_begin()));
+    for (auto v : mesh.vertices()) {
+        box_min.minimize(Vector(mesh.point(v)));
+        box_max.maximize(Vector(mesh.point(v)));
+    }
+    if (with_supports)
+        for (auto v : supportMesh.vertices()) {
+            box_min.minimize(Vector(supportMesh.point(v)));
+            box_max.maximize(Vector(supportMesh.point(v)));
+        }
 }
 
 void MyViewer::setupCamera() {
     // Set camera on the model
     Vector box_min, box_max;
-    box_min = box_max = mesh.point(*mesh.vertices_begin());
-    for (auto v : mesh.vertices()) {
-        box_min.minimize(mesh.point(v));
-        box_max.maximize(mesh.point(v));
-    }
+    boundingBox(box_min, box_max, false);
     camera()->setSceneBoundingBox(Vec(box_min.data()), Vec(box_max.data()));
     camera()->showEntireScene();
 
@@ -369,18 +622,36 @@ void MyViewer::setupCamera() {
 }
 
 bool MyViewer::openMesh(const std::string &filename, bool update_view) {
-    supportMesh.clear();
-    if (!OpenMesh::IO::read_mesh(mesh, filename) || mesh.n_vertices() == 0)
+    if (isBusy())
         return false;
-    model_type = ModelType::MESH;
-    last_filename = filename;
-    updateMesh(update_view);
+    supportMesh.clear();
+    strutFaces.clear();
+    selected_vertex = -1;
+    grid_resolution = 0;
+    fairing.reset();
+    topology_changed = true;
+    if (loadMeshCache(filename)) {
+        model_type = ModelType::MESH;
+        last_filename = filename;
+        finishMeshUpdate(update_view);
+    } else {
+        if (!OpenMesh::IO::read_mesh(mesh, filename) || mesh.n_vertices() == 0)
+            return false;
+        model_type = ModelType::MESH;
+        last_filename = filename;
+        updateMesh(update_view);
+        saveMeshCache(filename);
+    }
+    supportTree.clear(); // use the tree of an earlier session, if there is one
+    loadSupportTree(supportTreeCacheFile(), supportTree);
     if (update_view)
         setupCamera();
     return true;
 }
 
 bool MyViewer::openBezier(const std::string &filename, bool update_view) {
+    if (isBusy())
+        return false;
     size_t n, m;
     try {
         std::ifstream f(filename.c_str());
@@ -396,36 +667,175 @@ bool MyViewer::openBezier(const std::string &filename, bool update_view) {
     }
     model_type = ModelType::BEZIER_SURFACE;
     last_filename = filename;
+    selected_vertex = -1;
     updateMesh(update_view);
+    strutFaces.clear(); // supportMesh no longer shows supportTree
+    supportTree.clear(); // use the tree of an earlier session, if there is one
+    loadSupportTree(supportTreeCacheFile(), supportTree);
     if (update_view)
         setupCamera();
     return true;
 }
 
+// Directory for data that can be recomputed, created when needed
+static QString cacheDirectory(const QString &name) {
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/" + name;
+    QDir().mkpath(dir);
+    return dir;
+}
+
+// Preprocessed meshes are stored in a native format, that is memory-mapped when read:
+// this header, followed by the vertex positions, vertex normals, face normals
+// and mean curvatures (as Scalar), and finally the vertex indices of the faces (as int32_t).
+// The header tells what the data was computed from, and with what settings.
+struct MeshCacheHeader {
+    char magic[8];
+    uint64_t source_size;
+    int64_t source_time;      // modification time in ms
+    uint32_t scalar_size;
+    uint32_t curvature;       // the method of updateMesh
+    uint64_t n_vertices, n_faces;
+};
+
+static const char meshCacheMagic[8] = { 'M', 'E', 'S', 'H', 'C', 'C', 'H', '1' };
+#if defined(USE_JET_FITTING)
+static const uint32_t meshCacheCurvature = 2;
+#elif defined(BETTER_MEAN_CURVATURE)
+static const uint32_t meshCacheCurvature = 1;
+#else
+static const uint32_t meshCacheCurvature = 0;
+#endif
+
+// The cache file of a mesh file, named after its absolute path
+static QString meshCacheFile(const std::string &filename) {
+    QString path = QFileInfo(QString::fromStdString(filename)).absoluteFilePath();
+    QByteArray hash = QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Sha1);
+    return cacheDirectory("meshes") + "/" + QString(hash.toHex()) + ".mesh";
+}
+
+// Fills `mesh` with its normals and curvature from the cache, when it is up to date
+bool MyViewer::loadMeshCache(const std::string &filename) {
+    QFileInfo source(QString::fromStdString(filename));
+    QFile file(meshCacheFile(filename));
+    if (!source.exists() || !file.open(QFile::ReadOnly) || file.size() < (qint64)sizeof(MeshCacheHeader))
+        return false;
+    const uchar *data = file.map(0, file.size());
+    if (!data)
+        return false;
+    MeshCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    size_t nv = header.n_vertices, nf = header.n_faces;
+    auto points = reinterpret_cast<const Scalar *>(data + sizeof(header));
+    auto normals = points + 3 * nv, face_normals = normals + 3 * nv, mean = face_normals + 3 * nf;
+    auto faces = reinterpret_cast<const int32_t *>(mean + nv);
+    bool valid = std::equal(header.magic, header.magic + 8, meshCacheMagic) &&
+        header.source_size == (uint64_t)source.size() &&
+        header.source_time == source.lastModified().toMSecsSinceEpoch() &&
+        header.scalar_size == sizeof(Scalar) && header.curvature == meshCacheCurvature &&
+        nv > 0 && (uint64_t)file.size() ==
+        sizeof(header) + (7 * nv + 3 * nf) * sizeof(Scalar) + 3 * nf * sizeof(int32_t) &&
+        std::all_of(faces, faces + 3 * nf, [nv](int32_t i) { return i >= 0 && (size_t)i < nv; });
+    if (valid) {
+        mesh.clear();
+        mesh.request_face_normals(); mesh.request_halfedge_normals(); mesh.request_vertex_normals();
+        mesh.reserve(nv, 3 * nf / 2, nf);
+        for (size_t i = 0; i < nv; ++i)
+            mesh.add_vertex(MyMesh::Point(points[3*i], points[3*i+1], points[3*i+2]));
+        for (size_t i = 0; i < nf; ++i)
+            mesh.add_face(MyMesh::VertexHandle(faces[3*i]), MyMesh::VertexHandle(faces[3*i+1]),
+                          MyMesh::VertexHandle(faces[3*i+2]));
+        valid = mesh.n_faces() == nf; // otherwise the file is read again
+    }
+    if (valid) {
+        for (auto v : mesh.vertices()) {
+            size_t i = v.idx();
+            mesh.set_normal(v, MyMesh::Normal(normals[3*i], normals[3*i+1], normals[3*i+2]));
+            mesh.data(v).mean = mean[i];
+        }
+        for (auto f : mesh.faces()) {
+            size_t i = f.idx();
+            mesh.set_normal(f, MyMesh::Normal(face_normals[3*i], face_normals[3*i+1], face_normals[3*i+2]));
+        }
+        mesh.update_halfedge_normals();
+#ifdef USE_JET_FITTING
+        jet_nearest.reset(); // fitted on other points
+#endif
+    }
+    file.unmap(const_cast<uchar *>(data));
+    return valid;
+}
+
+// Called after updateMesh
+void MyViewer::saveMeshCache(const std::string &filename) const {
+    QFileInfo source(QString::fromStdString(filename));
+    MeshCacheHeader header;
+    std::copy(meshCacheMagic, meshCacheMagic + 8, header.magic);
+    header.source_size = source.size();
+    header.source_time = source.lastModified().toMSecsSinceEpoch();
+    header.scalar_size = sizeof(Scalar);
+    header.curvature = meshCacheCurvature;
+    header.n_vertices = mesh.n_vertices();
+    header.n_faces = mesh.n_faces();
+    std::vector<Scalar> data;
+    data.reserve(7 * mesh.n_vertices() + 3 * mesh.n_faces());
+    for (auto v : mesh.vertices())
+        data.insert(data.end(), mesh.point(v).data(), mesh.point(v).data() + 3);
+    for (auto v : mesh.vertices())
+        data.insert(data.end(), mesh.normal(v).data(), mesh.normal(v).data() + 3);
+    for (auto f : mesh.faces())
+        data.insert(data.end(), mesh.normal(f).data(), mesh.normal(f).data() + 3);
+    for (auto v : mesh.vertices())
+        data.push_back(mesh.data(v).mean);
+    std::vector<int32_t> faces(topology.faces.begin(), topology.faces.end());
+    QString cache = meshCacheFile(filename);
+    std::string temporary = cache.toStdString() + ".part";
+    {
+        std::ofstream f(temporary, std::ios::binary);
+        f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        f.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(Scalar));
+        f.write(reinterpret_cast<const char *>(faces.data()), faces.size() * sizeof(int32_t));
+        if (!f)
+            return;
+    }
+    QFile::remove(cache);
+    QFile::rename(QString::fromStdString(temporary), cache);
+}
+
 bool MyViewer::saveMesh(const std::string &filename) {
     if (model_type == ModelType::BEZIER_SURFACE)
         return saveBezier(filename);
-    MyMesh combined = mesh;
+    if (isBusy())
+        return false;
 
-    emit startComputation(tr("Exporting file"));
-    size_t numVerticesInMesh = mesh.n_vertices();
-    for (MyMesh::VertexIter v_it = supportMesh.vertices_begin(); v_it != supportMesh.vertices_end(); ++v_it) {
-        MyMesh::Point p = supportMesh.point(*v_it);
-        combined.add_vertex(p);
-    }
+    auto combined = std::make_shared<MyMesh>(mesh);
+    auto support = std::make_shared<MyMesh>(supportMesh);
+    auto written = std::make_shared<bool>(false);
+    runAsync(tr("Exporting file"), [this, combined, support, filename, written]() -> Publish {
+        support->garbage_collection(); // struts of edited branches may be deleted
+        size_t numVerticesInMesh = combined->n_vertices();
+        for (MyMesh::VertexIter v_it = support->vertices_begin(); v_it != support->vertices_end(); ++v_it) {
+            MyMesh::Point p = support->point(*v_it);
+            combined->add_vertex(p);
+        }
 
-    for (MyMesh::FaceIter f_it = supportMesh.faces_begin(); f_it != supportMesh.faces_end(); ++f_it) {
-        std::vector<MyMesh::VertexHandle> faceVertices;
-        for (MyMesh::FaceVertexIter fv_it = supportMesh.fv_iter(*f_it); fv_it.is_valid(); ++fv_it) {
-            MyMesh::VertexHandle v = *fv_it;
-            int newIndex = combined.vertex_handle(v.idx()).idx() + numVerticesInMesh;
-            faceVertices.push_back(MyMesh::VertexHandle(newIndex));
+        for (MyMesh::FaceIter f_it = support->faces_begin(); f_it != support->faces_end(); ++f_it) {
+            std::vector<MyMesh::VertexHandle> faceVertices;
+            for (MyMesh::FaceVertexIter fv_it = support->fv_iter(*f_it); fv_it.is_valid(); ++fv_it) {
+                MyMesh::VertexHandle v = *fv_it;
+                int newIndex = v.idx() + numVerticesInMesh;
+                faceVertices.push_back(MyMesh::VertexHandle(newIndex));
+            }
+            combined->add_face(faceVertices);
         }
-        combined.add_face(faceVertices);
-    }
-    emit endComputation();
 
-    return OpenMesh::IO::write_mesh(combined, filename);
+        *written = OpenMesh::IO::write_mesh(*combined, filename);
+        if (*written || !asynchronous) // the caller reports synchronous failures
+            return nullptr;
+        return [this, filename]() {
+            emit computationFailed(tr("Could not save file: ") + QString::fromStdString(filename) + ".");
+        };
+    });
+    return asynchronous || *written;
 }
 
 bool MyViewer::saveBezier(const std::string &filename) {
@@ -441,6 +851,81 @@ bool MyViewer::saveBezier(const std::string &filename) {
     return true;
 }
 
+#ifdef USE_OFFSCREEN
+
+bool MyViewer::renderViews(const std::string &prefix, size_t views, int size,
+                           const std::string &mode) {
+    // Renders `views` images of the model and its supports from evenly spaced directions
+    // around the Z axis, and saves them as <prefix>-<i>.png
+    if (model_type == ModelType::NONE || views == 0)
+        return false;
+
+    // The context (with its textures) is kept for the next models of the same size
+    bool fresh = !offscreen || offscreen->width() != size || offscreen->height() != size;
+    if (fresh) {
+        offscreen.reset(); // first, as it terminates the EGL display, which the new one would share
+        offscreen.reset(new OffscreenContext(size, size));
+    }
+    OffscreenContext &context = *offscreen;
+    if (!context.makeCurrent())
+        return false;
+
+    if (fresh) {
+        // Same state as QGLViewer::initializeGL(), but with a white background
+        glEnable(GL_LIGHT0);
+        glEnable(GL_LIGHTING);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_COLOR_MATERIAL);
+        glClearColor(1.0, 1.0, 1.0, 1.0);
+        init();
+    }
+    if (!setVisualization(mode)) {
+        context.doneCurrent();
+        return false;
+    }
+
+    // Frame the model together with its supports
+    Vector box_min, box_max;
+    boundingBox(box_min, box_max, true);
+    camera()->setScreenWidthAndHeight(size, size);
+    camera()->setSceneBoundingBox(Vec(box_min.data()), Vec(box_max.data()));
+    camera()->setUpVector(Vec(0.0, 0.0, 1.0));
+
+    // The geometry is sent to OpenGL only once, and replayed for every view
+    GLuint list = glGenLists(1);
+    glNewList(list, GL_COMPILE);
+    draw();
+    glEndList();
+
+    bool ok = true;
+    std::vector<unsigned char> pixels(size * size * 4);
+    double elevation = degToRad(30);
+    for (size_t i = 0; i < views; ++i) {
+        double azimuth = 2 * M_PI * i / views;
+        camera()->setViewDirection(-Vec(std::cos(elevation) * std::cos(azimuth),
+                                        std::cos(elevation) * std::sin(azimuth),
+                                        std::sin(elevation)));
+        camera()->showEntireScene();
+
+        glViewport(0, 0, size, size);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        camera()->loadProjectionMatrix();
+        camera()->loadModelViewMatrix();
+        glCallList(list);
+
+        glReadPixels(0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        QImage image(pixels.data(), size, size, QImage::Format_RGBA8888);
+        auto filename = QString::fromStdString(prefix + "-" + std::to_string(i) + ".png");
+        ok = image.mirrored().save(filename) && ok; // OpenGL rows go bottom-up
+    }
+
+    glDeleteLists(list, 1);
+    context.doneCurrent();
+    return ok;
+}
+
+#endif // USE_OFFSCREEN
+
 void MyViewer::init() {
     glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, 1);
 
@@ -503,9 +988,9 @@ void MyViewer::draw() {
                 if (visualization == Visualization::MEAN)
                     glColor3dv(meanMapColor(mesh.data(v).mean));
                 else if (visualization == Visualization::SLICING)
-                    glTexCoord1d(mesh.point(v) | slicing_dir * slicing_scaling);
-                glNormal3dv(mesh.normal(v).data());
-                glVertex3dv(mesh.point(v).data());
+                    glTexCoord1d(Vector(mesh.point(v)) | slicing_dir * slicing_scaling);
+                glNormal(mesh.normal(v));
+                glVertex(mesh.point(v));
             }
             glEnd();
         }
@@ -526,14 +1011,14 @@ void MyViewer::draw() {
         for (auto f : mesh.faces()) {
             glBegin(GL_POLYGON);
             for (auto v : mesh.fv_range(f))
-                glVertex3dv(mesh.point(v).data());
+                glVertex(mesh.point(v));
             glEnd();
         }
         glEnable(GL_LIGHTING);
     }
 
-    // for Clever Support
-    if (showWhereSupportNeeded) {
+    // for Clever Support (these overlays share data with the background computations)
+    if (showWhereSupportNeeded && !isBusy()) {
         colorFacesEdgesAndPoints();
         if (showCones) {
             generateCones();
@@ -546,8 +1031,8 @@ void MyViewer::draw() {
         glColor3d(1.0, 0.5, 0.0);
         glBegin(GL_POLYGON);
         for (auto v : supportMesh.fv_range(f)) {
-            glNormal3dv(supportMesh.normal(v).data());
-            glVertex3dv(supportMesh.point(v).data());
+            glNormal(supportMesh.normal(v));
+            glVertex(supportMesh.point(v));
         }
 
         glEnd();
@@ -598,6 +1083,17 @@ void MyViewer::drawWithNames() {
     if (axes.shown)
         return drawAxesWithNames();
 
+    if (showTree) {
+        // Contacts of the support tree instead of the model
+        for (size_t i = 0; i < supportTree.size(); ++i)
+            if (isSupportContact(i)) {
+                glPushName(i);
+                glRasterPos3dv(supportTree.positions[i]);
+                glPopName();
+            }
+        return;
+    }
+
     switch (model_type) {
     case ModelType::NONE: break;
     case ModelType::MESH:
@@ -605,7 +1101,7 @@ void MyViewer::drawWithNames() {
             return;
         for (auto v : mesh.vertices()) {
             glPushName(v.idx());
-            glRasterPos3dv(mesh.point(v).data());
+            glRasterPos3dv(Vector(mesh.point(v)).data());
             glPopName();
         }
         break;
@@ -638,7 +1134,17 @@ void MyViewer::drawAxesWithNames() const {
 void MyViewer::postSelection(const QPoint &p) {
     int sel = selectedName();
     if (sel == -1) {
+        // A click on the model adds a support there
+        bool adding = showTree && !axes.shown;
         axes.shown = false;
+        selected_vertex = -1;
+        selected_support = -1;
+        if (adding) {
+            bool found;
+            Vec location = camera()->pointUnderPixel(p, found);
+            if (found && addSupportPoint(location) >= 0)
+                update();
+        }
         return;
     }
 
@@ -652,11 +1158,18 @@ void MyViewer::postSelection(const QPoint &p) {
         return;
     }
 
-    selected_vertex = sel;
-    if (model_type == ModelType::MESH)
-        axes.position = Vec(mesh.point(MyMesh::VertexHandle(sel)).data());
-    if (model_type == ModelType::BEZIER_SURFACE)
-        axes.position = control_points[sel];
+    if (showTree) {
+        selected_vertex = -1;
+        selected_support = sel;
+        axes.position = supportTree.positions[sel];
+    } else {
+        selected_vertex = sel;
+        selected_support = -1;
+        if (model_type == ModelType::MESH)
+            axes.position = Vec(mesh.point(MyMesh::VertexHandle(sel)).data());
+        if (model_type == ModelType::BEZIER_SURFACE)
+            axes.position = control_points[sel];
+    }
     double depth = camera()->projectedCoordinatesOf(axes.position)[2];
     Vec q1 = camera()->unprojectedCoordinatesOf(Vec(0.0, 0.0, depth));
     Vec q2 = camera()->unprojectedCoordinatesOf(Vec(width(), height(), depth));
@@ -666,7 +1179,9 @@ void MyViewer::postSelection(const QPoint &p) {
 }
 
 void MyViewer::keyPressEvent(QKeyEvent *e) {
-    if (e->modifiers() == Qt::NoModifier)
+    if (isBusy()) // the model is in use by a background computation
+        QGLViewer::keyPressEvent(e);
+    else if (e->modifiers() == Qt::NoModifier)
         switch (e->key()) {
         case Qt::Key_R:
             if (model_type == ModelType::MESH)
@@ -720,10 +1235,33 @@ void MyViewer::keyPressEvent(QKeyEvent *e) {
             fairMesh();
             update();
             break;
+        case Qt::Key_T:
+            adaptive_tessellation = !adaptive_tessellation;
+            if (model_type == ModelType::BEZIER_SURFACE)
+                updateMesh();
+            update();
+            break;
         case Qt::Key_X:
             showWhereSupportNeeded = !showWhereSupportNeeded;
+            if (showWhereSupportNeeded) {
+                getElementsThatNeedSupport();
+                double area = 0.0;
+                for (const auto &island : overhangIslands)
+                    area += island.area;
+                displayMessage(tr("%1 overhang islands, total area: %2")
+                               .arg(overhangIslands.size()).arg(area));
+            }
             update();
             break;
+        case Qt::Key_Delete:
+            if (axes.shown && selected_support >= 0) {
+                removeSupportPoint(selected_support);
+                compactStruts();
+                selected_support = -1;
+                axes.shown = false;
+                update();
+            }
+            break;
         default:
             QGLViewer::keyPressEvent(e);
         }
@@ -744,6 +1282,10 @@ void MyViewer::keyPressEvent(QKeyEvent *e) {
         }
     else if (e->modifiers() == Qt::AltModifier)
         switch (e->key()) {
+        case Qt::Key_F:
+            fairMeshImplicit();
+            update();
+            break;
         case Qt::Key_X:
             showAllPoints = !showAllPoints;
             update();
@@ -753,6 +1295,25 @@ void MyViewer::keyPressEvent(QKeyEvent *e) {
         QGLViewer::keyPressEvent(e);
 }
 
+bool MyViewer::setVisualization(const std::string &mode) {
+    // Same as the corresponding hotkeys
+    if (mode == "plain")
+        visualization = Visualization::PLAIN;
+    else if (mode == "mean")
+        visualization = Visualization::MEAN;
+    else if (mode == "slicing")
+        visualization = Visualization::SLICING;
+    else if (mode == "isophotes") {
+        visualization = Visualization::ISOPHOTES;
+        current_isophote_texture = isophote_texture;
+    } else if (mode == "environment") {
+        visualization = Visualization::ISOPHOTES;
+        current_isophote_texture = environment_texture;
+    } else
+        return false;
+    return true;
+}
+
 Vec MyViewer::intersectLines(const Vec &ap, const Vec &ad, const Vec &bp, const Vec &bd) {
     // always returns a point on the (ap, ad) line
     double a = ad * ad, b = ad * bd, c = bd * bd;
@@ -778,42 +1339,295 @@ void MyViewer::bernsteinAll(size_t n, double u, std::vector<double> &coeff) {
     }
 }
 
+void MyViewer::bernsteinDerivatives(size_t n, size_t order, double u, std::vector<double> &coeff) {
+    // Uses (B^d_k)' = d * (B^{d-1}_{k-1} - B^{d-1}_k), starting from degree n - order
+    if (order > n) {
+        coeff.assign(n + 1, 0.0);
+        return;
+    }
+    bernsteinAll(n - order, u, coeff);
+    for (size_t d = n - order + 1; d <= n; ++d) {
+        coeff.push_back(0.0);
+        for (size_t k = d; k > 0; --k)
+            coeff[k] = d * (coeff[k - 1] - coeff[k]);
+        coeff[0] *= -(double)d;
+    }
+}
+
+void MyViewer::updateBezierBasis(size_t resolution) {
+    auto &basis = bezier_basis;
+    if (basis.resolution == resolution && basis.degree[0] == degree[0] && basis.degree[1] == degree[1])
+        return;
+    basis.resolution = resolution;
+    basis.degree[0] = degree[0];
+    basis.degree[1] = degree[1];
+    std::vector<double> *tables[2][3] = {
+        { &basis.u, &basis.du, &basis.duu },
+        { &basis.v, &basis.dv, &basis.dvv }
+    };
+    for (size_t d = 0; d < 2; ++d)
+        for (size_t order = 0; order < 3; ++order) {
+            tables[d][order]->clear();
+            tables[d][order]->reserve(resolution * (degree[d] + 1));
+        }
+    std::vector<double> coeff;
+    for (size_t i = 0; i < resolution; ++i) {
+        double t = (double)i / (double)(resolution - 1);
+        for (size_t d = 0; d < 2; ++d)
+            for (size_t order = 0; order < 3; ++order) {
+                bernsteinDerivatives(degree[d], order, t, coeff);
+                tables[d][order]->insert(tables[d][order]->end(), coeff.begin(), coeff.end());
+            }
+    }
+}
+
+// Normal and mean curvature from the partial derivatives Su, Sv, Suu, Suv, Svv.
+// The normal is oriented like the triangles of the tessellation, i.e., as Sv x Su,
+// and the sign of the curvature follows the discrete estimation (positive where convex).
+// Returns false at singular points (e.g. where a boundary curve degenerates to a point).
+bool MyViewer::bezierNormalAndMean(const Vector *der, Vector &normal, double &mean) {
+    const auto &su = der[0], &sv = der[1], &suu = der[2], &suv = der[3], &svv = der[4];
+    normal = sv % su;
+    double E = su | su, F = su | sv, G = sv | sv;
+    double len = normal.norm();
+    if (len < 1.0e-10 * (E + G))
+        return false;
+    normal /= len;
+    double L = suu | normal, M = suv | normal, N = svv | normal;
+    mean = -(E * N - 2 * F * M + G * L) / (2 * len * len); // len^2 = EG - F^2
+    return true;
+}
+
+MyViewer::Vector MyViewer::evaluateBezier(double u, double v, Vector *derivatives) const {
+    size_t n = degree[0], m = degree[1];
+    size_t orders = derivatives ? 3 : 1, count = derivatives ? 6 : 1;
+    std::vector<double> coeff_u[3], coeff_v[3];
+    for (size_t order = 0; order < orders; ++order) {
+        bernsteinDerivatives(n, order, u, coeff_u[order]);
+        bernsteinDerivatives(m, order, v, coeff_v[order]);
+    }
+    // Orders of differentiation in u and v for S, Su, Sv, Suu, Suv, Svv
+    static const size_t uv_orders[6][2] = { { 0, 0 }, { 1, 0 }, { 0, 1 }, { 2, 0 }, { 1, 1 }, { 0, 2 } };
+    Vector result[6];
+    for (size_t d = 0; d < count; ++d)
+        result[d].vectorize(0.0);
+    for (size_t k = 0, index = 0; k <= n; ++k)
+        for (size_t l = 0; l <= m; ++l, ++index) {
+            const auto &cp = control_points[index];
+            Vector p(cp[0], cp[1], cp[2]);
+            for (size_t d = 0; d < count; ++d)
+                result[d] += p * (coeff_u[uv_orders[d][0]][k] * coeff_v[uv_orders[d][1]][l]);
+        }
+    for (size_t d = 1; d < count; ++d)
+        derivatives[d - 1] = result[d];
+    return result[0];
+}
+
+void MyViewer::updateSingularPoints(const std::vector<MyMesh::VertexHandle> &singular) {
+    // Fall back to the faces, and to the curvature of the neighbors
+    for (auto v : singular) {
+        mesh.set_normal(v, mesh.calc_vertex_normal(v));
+        double sum = 0.0;
+        size_t count = 0;
+        for (auto w : mesh.vv_range(v))
+            if (std::find(singular.begin(), singular.end(), w) == singular.end()) {
+                sum += mesh.data(w).mean;
+                ++count;
+            }
+        mesh.data(v).mean = count ? sum / count : 0.0;
+    }
+}
+
 void MyViewer::generateMesh(size_t resolution) {
-    mesh.clear();
-    std::vector<MyMesh::VertexHandle> handles, tri;
     size_t n = degree[0], m = degree[1];
+    updateBezierBasis(resolution);
+
+    // The grid points are Bu * P * Bv^T (for each coordinate),
+    // where Bu and Bv hold the Bernstein polynomials evaluated at the grid parameters;
+    // the partial derivatives come the same way, using the derivatives of Bu and Bv
+    using Matrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    auto table = [resolution](const std::vector<double> &values, size_t deg) {
+        return Eigen::Map<const Matrix>(values.data(), resolution, deg + 1);
+    };
+    auto Bu = table(bezier_basis.u, n), Du = table(bezier_basis.du, n), DDu = table(bezier_basis.duu, n);
+    auto Bv = table(bezier_basis.v, m), Dv = table(bezier_basis.dv, m), DDv = table(bezier_basis.dvv, m);
+    Matrix P(n + 1, m + 1), Q, S[3], Su[3], Sv[3], Suu[3], Suv[3], Svv[3];
+    for (size_t c = 0; c < 3; ++c) {
+        for (size_t k = 0, index = 0; k <= n; ++k)
+            for (size_t l = 0; l <= m; ++l, ++index)
+                P(k, l) = control_points[index][c];
+        Q.noalias() = P * Bv.transpose();
+        S[c].noalias() = Bu * Q;
+        Su[c].noalias() = Du * Q;
+        Suu[c].noalias() = DDu * Q;
+        Q.noalias() = P * Dv.transpose();
+        Sv[c].noalias() = Bu * Q;
+        Suv[c].noalias() = Du * Q;
+        Q.noalias() = P * DDv.transpose();
+        Svv[c].noalias() = Bu * Q;
+    }
+    auto at = [](const Matrix *M, size_t i, size_t j) {
+        return Vector(M[0](i, j), M[1](i, j), M[2](i, j));
+    };
 
-    std::vector<double> coeff_u, coeff_v;
-    for (size_t i = 0; i < resolution; ++i) {
-        double u = (double)i / (double)(resolution - 1);
-        bernsteinAll(n, u, coeff_u);
-        for (size_t j = 0; j < resolution; ++j) {
-            double v = (double)j / (double)(resolution - 1);
-            bernsteinAll(m, v, coeff_v);
-            Vec p(0.0, 0.0, 0.0);
-            for (size_t k = 0, index = 0; k <= n; ++k)
-                for (size_t l = 0; l <= m; ++l, ++index)
-                    p += control_points[index] * coeff_u[k] * coeff_v[l];
-            handles.push_back(mesh.add_vertex(Vector(static_cast<double *>(p))));
+    if (grid_resolution != resolution) {
+        mesh.clear();
+        topology_changed = true;
+        std::vector<MyMesh::VertexHandle> handles, tri;
+        handles.reserve(resolution * resolution);
+        for (size_t i = 0; i < resolution * resolution; ++i)
+            handles.push_back(mesh.add_vertex(MyMesh::Point(0.0, 0.0, 0.0)));
+        for (size_t i = 0; i < resolution - 1; ++i)
+            for (size_t j = 0; j < resolution - 1; ++j) {
+                tri.clear();
+                tri.push_back(handles[i * resolution + j]);
+                tri.push_back(handles[i * resolution + j + 1]);
+                tri.push_back(handles[(i + 1) * resolution + j]);
+                mesh.add_face(tri);
+                tri.clear();
+                tri.push_back(handles[(i + 1) * resolution + j]);
+                tri.push_back(handles[i * resolution + j + 1]);
+                tri.push_back(handles[(i + 1) * resolution + j + 1]);
+                mesh.add_face(tri);
+            }
+        grid_resolution = resolution;
+    }
+
+    std::vector<MyMesh::VertexHandle> singular;
+    for (size_t i = 0, index = 0; i < resolution; ++i)
+        for (size_t j = 0; j < resolution; ++j, ++index) {
+            MyMesh::VertexHandle v(index);
+            mesh.set_point(v, MyMesh::Point(at(S, i, j)));
+            Vector der[] = { at(Su, i, j), at(Sv, i, j), at(Suu, i, j), at(Suv, i, j), at(Svv, i, j) };
+            Vector normal;
+            double mean = 0.0;
+            if (bezierNormalAndMean(der, normal, mean))
+                mesh.set_normal(v, MyMesh::Normal(normal));
+            else
+                singular.push_back(v);
+            mesh.data(v).mean = mean;
+        }
+
+    mesh.update_face_normals();
+    updateSingularPoints(singular);
+}
+
+double MyViewer::controlNetSize() const {
+    // Diagonal of the bounding box
+    Vector box_min, box_max;
+    box_min.vectorize(std::numeric_limits<double>::max());
+    box_max.vectorize(std::numeric_limits<double>::lowest());
+    for (const auto &cp : control_points) {
+        box_min.minimize(Vector(cp[0], cp[1], cp[2]));
+        box_max.maximize(Vector(cp[0], cp[1], cp[2]));
+    }
+    return control_points.empty() ? 0.0 : (box_max - box_min).norm();
+}
+
+void MyViewer::generateAdaptiveMesh(double tolerance) {
+    // Quadtree subdivision of the parameter domain, on a grid of 2^max_depth cells per side;
+    // a cell is split until the surface deviates from its bilinear interpolant by at most
+    // the given chordal tolerance at the midpoints of its edges and at its center
+    const size_t min_depth = 3, max_depth = 8, size = 1 << max_depth;
+    auto index = [size](size_t i, size_t j) { return i * (size + 1) + j; };
+    std::vector<Vector> points((size + 1) * (size + 1));
+    std::vector<bool> evaluated(points.size(), false);
+    auto point = [&](size_t i, size_t j) -> const Vector & {
+        size_t k = index(i, j);
+        if (!evaluated[k]) {
+            points[k] = evaluateBezier((double)i / size, (double)j / size);
+            evaluated[k] = true;
         }
+        return points[k];
+    };
+    auto isFlat = [&](size_t i, size_t j, size_t s) {
+        size_t h = s / 2;
+        const auto &p00 = point(i, j), &p10 = point(i + s, j);
+        const auto &p01 = point(i, j + s), &p11 = point(i + s, j + s);
+        double error = std::max({ (point(i + h, j) - (p00 + p10) / 2).norm(),
+                                  (point(i + h, j + s) - (p01 + p11) / 2).norm(),
+                                  (point(i, j + h) - (p00 + p01) / 2).norm(),
+                                  (point(i + s, j + h) - (p10 + p11) / 2).norm(),
+                                  (point(i + h, j + h) - (p00 + p10 + p01 + p11) / 4).norm() });
+        return error <= tolerance;
+    };
+
+    struct Cell { size_t i, j, size; }; // lower corner and size in grid units (i ~ u, j ~ v)
+    std::vector<Cell> stack = { { 0, 0, size } }, leaves;
+    while (!stack.empty()) {
+        auto c = stack.back();
+        stack.pop_back();
+        if (c.size <= (size >> min_depth) && (c.size == 1 || isFlat(c.i, c.j, c.size))) {
+            leaves.push_back(c);
+            continue;
+        }
+        size_t h = c.size / 2;
+        stack.push_back({ c.i,     c.j,     h });
+        stack.push_back({ c.i + h, c.j,     h });
+        stack.push_back({ c.i,     c.j + h, h });
+        stack.push_back({ c.i + h, c.j + h, h });
     }
-    for (size_t i = 0; i < resolution - 1; ++i)
-        for (size_t j = 0; j < resolution - 1; ++j) {
-            tri.clear();
-            tri.push_back(handles[i * resolution + j]);
-            tri.push_back(handles[i * resolution + j + 1]);
-            tri.push_back(handles[(i + 1) * resolution + j]);
-            mesh.add_face(tri);
-            tri.clear();
-            tri.push_back(handles[(i + 1) * resolution + j]);
-            tri.push_back(handles[i * resolution + j + 1]);
-            tri.push_back(handles[(i + 1) * resolution + j + 1]);
-            mesh.add_face(tri);
+
+    // Vertices are indexed by their quantized parameters,
+    // so adjacent cells of different sizes find each other's corners on their common sides
+    mesh.clear();
+    topology_changed = true;
+    grid_resolution = 0;
+    std::vector<int> vertex(points.size(), -1);
+    std::vector<MyMesh::VertexHandle> singular;
+    auto addVertex = [&](size_t i, size_t j) {
+        Vector der[5], normal;
+        double mean = 0.0;
+        auto v = mesh.add_vertex(MyMesh::Point(evaluateBezier((double)i / size, (double)j / size, der)));
+        if (bezierNormalAndMean(der, normal, mean))
+            mesh.set_normal(v, MyMesh::Normal(normal));
+        else
+            singular.push_back(v);
+        mesh.data(v).mean = mean;
+        vertex[index(i, j)] = v.idx();
+        return v;
+    };
+    for (const auto &c : leaves)
+        for (size_t k = 0; k < 4; ++k) {
+            size_t i = c.i + (k & 1) * c.size, j = c.j + (k >> 1) * c.size;
+            if (vertex[index(i, j)] < 0)
+                addVertex(i, j);
         }
+
+    // Triangles are oriented as in the uniform grid, i.e., clockwise in the (u, v) plane
+    std::vector<MyMesh::VertexHandle> boundary, tri;
+    for (const auto &c : leaves) {
+        size_t i = c.i, j = c.j, s = c.size;
+        boundary.clear();
+        auto collect = [&](size_t i, size_t j) {
+            if (vertex[index(i, j)] >= 0)
+                boundary.push_back(MyMesh::VertexHandle(vertex[index(i, j)]));
+        };
+        for (size_t k = 0; k < s; ++k)
+            collect(i, j + k);
+        for (size_t k = 0; k < s; ++k)
+            collect(i + k, j + s);
+        for (size_t k = 0; k < s; ++k)
+            collect(i + s, j + s - k);
+        for (size_t k = 0; k < s; ++k)
+            collect(i + s - k, j);
+        if (boundary.size() == 4) {
+            mesh.add_face(boundary[0], boundary[1], boundary[3]);
+            mesh.add_face(boundary[3], boundary[1], boundary[2]);
+        } else {
+            // Finer neighbors have vertices on our sides: use a fan from the center
+            auto center = addVertex(i + s / 2, j + s / 2);
+            for (size_t k = 0; k < boundary.size(); ++k)
+                mesh.add_face(center, boundary[k], boundary[(k + 1) % boundary.size()]);
+        }
+    }
+
+    mesh.update_face_normals();
+    updateSingularPoints(singular);
 }
 
 void MyViewer::mouseMoveEvent(QMouseEvent *e) {
-    if (!axes.shown ||
+    if (isBusy() || !axes.shown ||
         (axes.selected_axis < 0 && !(e->modifiers() & Qt::ControlModifier)) ||
         !(e->modifiers() & (Qt::ShiftModifier | Qt::ControlModifier)) ||
         !(e->buttons() & Qt::LeftButton))
@@ -831,15 +1645,47 @@ void MyViewer::mouseMoveEvent(QMouseEvent *e) {
         axes.position[axes.selected_axis] = axes.original_pos[axes.selected_axis] + d;
     }
 
-    if (model_type == ModelType::MESH)
+    if (selected_support >= 0) {
+        // Only the contact and its short strut follow, the branch is routed again on release
+        dragSupportPoint(selected_support, axes.position);
+        dragging = true;
+        update();
+        return;
+    }
+
+    if (model_type == ModelType::MESH) {
         mesh.set_point(MyMesh::VertexHandle(selected_vertex),
-                       Vector(static_cast<double *>(axes.position)));
+                       MyMesh::Point(Vector(static_cast<double *>(axes.position))));
+        fairing.reset(); // its weights are for the old geometry
+    }
     if (model_type == ModelType::BEZIER_SURFACE)
         control_points[selected_vertex] = axes.position;
+    dragging = true;
     updateMesh();
     update();
 }
 
+void MyViewer::mouseReleaseEvent(QMouseEvent *e) {
+    if (dragging && !isBusy()) {
+        // The adaptive tessellation and the analysis are only made for the final position
+        dragging = false;
+        if (selected_vertex >= 0) {
+            if (model_type == ModelType::BEZIER_SURFACE && adaptive_tessellation)
+                updateMesh();
+            else
+                finishMeshUpdate(true);
+        }
+        if (selected_support >= 0) {
+            selected_support = moveSupportPoint(selected_support, axes.position);
+            if (selected_support < 0)
+                axes.shown = false;
+        }
+        compactStruts(); // the old struts of the branch are deleted
+        update();
+    }
+    QGLViewer::mouseReleaseEvent(e);
+}
+
 QString MyViewer::helpString() const {
     QString text("<h2>Sample Framework</h2>"
                  "<p>This is a minimal framework for 3D mesh manipulation, which can be "
@@ -862,11 +1708,16 @@ QString MyViewer::helpString() const {
                  "<li>&nbsp;S: Toggle solid (filled polygon) visualization</li>"
                  "<li>&nbsp;W: Toggle wireframe visualization</li>"
                  "<li>&nbsp;F: Fair mesh</li>"
+                 "<li>&nbsp;Alt+F: Fair mesh implicitly (fixing the boundary and the selected vertex)</li>"
+                 "<li>&nbsp;T: Toggle adaptive tessellation of Bezier surfaces</li>"
                  "</ul>"
                  "<p>There is also a simple selection and movement interface, enabled "
                  "only when the wireframe/controlnet is displayed: a mesh vertex can be selected "
                  "by shift-clicking, and it can be moved by shift-dragging one of the "
                  "displayed axes. Pressing ctrl enables movement in the screen plane.</p>"
+                 "<p>While the support tree is shown, its contacts are selected instead; "
+                 "a moved contact follows the model, shift-clicking elsewhere on the model "
+                 "adds a new one, and Delete removes the selected one, with its branch.</p>"
                  "<p>Note that libQGLViewer is furnished with a lot of useful features, "
                  "such as storing/loading view positions, or saving screenshots. "
                  "OpenMesh also has a nice collection of tools for mesh manipulation: "
@@ -892,8 +1743,8 @@ void MyViewer::colorFacesEdgesAndPoints(){
     for(auto f : facesToSupport){
         glBegin(GL_POLYGON);
         for(auto v : mesh.fv_range(f)){
-            glNormal3dv(mesh.normal(v).data());
-            glVertex3dv(mesh.point(v).data());
+            glNormal(mesh.normal(v));
+            glVertex(mesh.point(v));
         }
         glEnd();
     }
@@ -905,8 +1756,8 @@ void MyViewer::colorFacesEdgesAndPoints(){
     glDisable(GL_LIGHTING);
     glBegin(GL_LINES);
     for (auto e : edgesToSupport){
-        glVertex3dv(mesh.point(e.v0()).data());
-        glVertex3dv(mesh.point(e.v1()).data());
+        glVertex(mesh.point(e.v0()));
+        glVertex(mesh.point(e.v1()));
     }
     glEnd();
     glLineWidth(1.0);
@@ -921,7 +1772,7 @@ void MyViewer::colorFacesEdgesAndPoints(){
         glPointSize(5.0);
         glBegin(GL_POINTS);
         for (auto v : verticesToSupport){
-            glVertex3dv(mesh.point(v).data());
+            glVertex(mesh.point(v));
         }
         glEnd();
         glPointSize(1.0);
@@ -929,46 +1780,129 @@ void MyViewer::colorFacesEdgesAndPoints(){
     }
 }
 
+// Overhang faces and local minima, grouped into islands in one union-find pass.
+// A local minimum is a vertex, or a plateau of vertices at the same height, without lower neighbors;
+// its vertices are supported one by one, or along the edges of the plateau.
+// Overhang faces are joined across their edges, and minima with the overhang faces around them.
 void MyViewer::getElementsThatNeedSupport(){
-    facesToSupport.clear();
-    edgesToSupport.clear();
-    verticesToSupport.clear();
+    SupportElements elements = findElementsThatNeedSupport(angleLimit);
+    facesToSupport.swap(elements.faces);
+    edgesToSupport.swap(elements.edges);
+    verticesToSupport.swap(elements.vertices);
+    overhangIslands.swap(elements.islands);
+}
 
-    for(auto f : mesh.faces()){
-        if (angleOfVectors(Vec(mesh.normal(f).data()), Vec(0,0,1)) - degToRad(90.0) >= angleLimit){
-            facesToSupport.push_back(f);
-        }
-    }
+MyViewer::SupportElements MyViewer::findElementsThatNeedSupport(double angle) const {
+    SupportElements result;
+    auto &facesToSupport = result.faces;
+    auto &edgesToSupport = result.edges;
+    auto &verticesToSupport = result.vertices;
+    auto &overhangIslands = result.islands;
+
+    if (!snapshot)
+        return result;
+    const auto &geometry = *snapshot;
+    size_t n_faces = mesh.n_faces(), n_vertices = mesh.n_vertices();
+    auto z = [&](OpenMesh::VertexHandle v) { return geometry.point(v.idx())[2]; };
+
+    // Elements are the faces, followed by the vertices
+    std::vector<size_t> parent(n_faces + n_vertices);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](size_t i) {
+        while (parent[i] != i)
+            i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    auto unite = [&](size_t i, size_t j) {
+        i = find(i); j = find(j);
+        if (i != j)
+            parent[std::max(i, j)] = std::min(i, j); // the smallest index is the root
+    };
 
+    // Plateaus, and whether they are minima
+    for (auto e : mesh.edges())
+        if (z(e.v0()) == z(e.v1()))
+            unite(n_faces + e.v0().idx(), n_faces + e.v1().idx());
+    std::vector<bool> not_minimum(n_faces + n_vertices, false);
+    std::vector<size_t> plateau_size(n_faces + n_vertices, 0);
     for (auto v : mesh.vertices()) {
-        OpenMesh::SmartVertexHandle* lowestOfNeighbors = &v;
-        float lowestZ = mesh.point(v).data()[2];
-        std::vector<OpenMesh::SmartVertexHandle> equals;
-        for (auto vn : v.vertices()){
-            float vnZ = mesh.point(vn).data()[2];
-            if (vnZ < lowestZ){
-                lowestZ = vnZ;
-                lowestOfNeighbors = &vn;
-                equals.clear();
-            } else if (vnZ == lowestZ){
-                equals.push_back(vn);
-            }
-        }
-        if (lowestOfNeighbors == &v && Vec(mesh.normal(v).data()).z < 0){
-            if (equals.empty()){
-                verticesToSupport.push_back(v);
-            }
-            else if (equals.size() == 1){
-                for (auto e : mesh.edges()){
-                    if ((e.v0() == v && e.v1() == equals.back()) || (e.v1() == v && e.v0() == equals.back())){
-                        if (std::find(edgesToSupport.begin(), edgesToSupport.end(), e) == edgesToSupport.end()) {
-                            edgesToSupport.push_back(e);
-                        }
-                    }
-                }
-            }
+        size_t root = find(n_faces + v.idx());
+        ++plateau_size[root];
+        if (Vec(mesh.normal(v).data()).z >= 0)
+            not_minimum[root] = true;
+    }
+    for (auto e : mesh.edges()) {
+        auto higher = z(e.v0()) > z(e.v1()) ? e.v0() : e.v1();
+        if (z(e.v0()) != z(e.v1()))
+            not_minimum[find(n_faces + higher.idx())] = true;
+    }
+    std::vector<bool> minimum(n_vertices);
+    for (auto v : mesh.vertices()) {
+        size_t root = find(n_faces + v.idx());
+        minimum[v.idx()] = !not_minimum[root];
+        if (minimum[v.idx()] && plateau_size[root] == 1)
+            verticesToSupport.push_back(v);
+    }
+    for (auto e : mesh.edges())
+        if (minimum[e.v0().idx()] && z(e.v0()) == z(e.v1()))
+            edgesToSupport.push_back(e);
+
+    // Overhang regions
+    std::vector<bool> overhang(n_faces);
+    for (auto f : mesh.faces()) {
+        overhang[f.idx()] = angleOfVectors(Vec(geometry.normal(f.idx())), Vec(0,0,1)) - degToRad(90.0) >= angle;
+        if (overhang[f.idx()])
+            facesToSupport.push_back(f);
+    }
+    for (auto e : mesh.edges()) {
+        if (e.is_boundary())
+            continue;
+        auto f0 = e.h0().face(), f1 = e.h1().face();
+        if (overhang[f0.idx()] && overhang[f1.idx()])
+            unite(f0.idx(), f1.idx());
+    }
+    for (auto v : mesh.vertices())
+        if (minimum[v.idx()])
+            for (auto f : v.faces())
+                if (overhang[f.idx()])
+                    unite(f.idx(), n_faces + v.idx());
+
+    // Islands, in the order of their roots
+    std::vector<size_t> island(n_faces + n_vertices, std::numeric_limits<size_t>::max());
+    auto islandOf = [&](size_t element) -> OverhangIsland & {
+        size_t root = find(element);
+        if (island[root] == std::numeric_limits<size_t>::max()) {
+            island[root] = overhangIslands.size();
+            overhangIslands.push_back({ {}, {}, {}, 0.0, Vec(0.0, 0.0, std::numeric_limits<double>::max()) });
         }
+        return overhangIslands[island[root]];
+    };
+    auto lower = [&](OverhangIsland &is, size_t v) {
+        Vec p(geometry.point(v));
+        if (p.z < is.lowest.z)
+            is.lowest = p;
+    };
+    for (auto f : facesToSupport) {
+        auto &is = islandOf(f.idx());
+        Vec a(geometry.point(geometry.vertex(f.idx(), 0)));
+        Vec b(geometry.point(geometry.vertex(f.idx(), 1)));
+        Vec c(geometry.point(geometry.vertex(f.idx(), 2)));
+        for (size_t k = 0; k < 3; ++k)
+            lower(is, geometry.vertex(f.idx(), k));
+        is.faces.push_back(f);
+        is.area += ((b - a) ^ (c - a)).norm() / 2;
+    }
+    for (auto e : edgesToSupport) {
+        auto &is = islandOf(n_faces + e.v0().idx());
+        lower(is, e.v0().idx());
+        is.edges.push_back(e);
     }
+    for (auto v : verticesToSupport) {
+        auto &is = islandOf(n_faces + v.idx());
+        lower(is, v.idx());
+        is.vertices.push_back(v);
+    }
+    return result;
 }
 
 void MyViewer::showAllPointsToSupport(){
@@ -987,47 +1921,51 @@ void MyViewer::showAllPointsToSupport(){
 }
 
 void MyViewer::calculatePointsToSupport(){
-    pointsToSupport.clear();
+    pointsToSupport = findPointsToSupport(overhangIslands, gridDensity);
+}
 
-    for (auto v: verticesToSupport){
-        pointsToSupport.push_back(SupportPoint(vertexToVec(v), MODEL, Vec(mesh.normal(v).data())));
-    }
-    for (auto e : edgesToSupport){
-        MyMesh::Normal edgeNormal = (mesh.normal(e.h0()) + mesh.normal(e.h1())).normalize();
-        generateEdgePoints(vertexToVec(e.v0()), vertexToVec(e.v1()), gridDensity, Vec(edgeNormal.data()));
-    }
-    for (auto f : facesToSupport){
-        generateFacePoints(f);
+std::deque<MyViewer::SupportPoint> MyViewer::findPointsToSupport(const std::vector<OverhangIsland> &islands,
+                                                                 double density) const {
+    std::deque<SupportPoint> points;
+    for (const auto &island : islands){
+        for (auto v: island.vertices){
+            points.push_back(SupportPoint(vertexToVec(v), MODEL, Vec(mesh.normal(v).data())));
+        }
+        for (auto e : island.edges){
+            MyMesh::Normal edgeNormal = (mesh.normal(e.h0()) + mesh.normal(e.h1())).normalize();
+            generateEdgePoints(points, vertexToVec(e.v0()), vertexToVec(e.v1()), density, Vec(edgeNormal.data()));
+        }
+        for (auto f : island.faces){
+            generateFacePoints(points, f, density);
+        }
     }
-    sortPointsToSupport();
-    pointsToSupport.erase(std::unique( pointsToSupport.begin(), pointsToSupport.end() ), pointsToSupport.end());
+    std::sort(points.begin(), points.end(), isHigher);
+    points.erase(std::unique( points.begin(), points.end() ), points.end());
+    return points;
 }
 
-void MyViewer::generateEdgePoints(Vec A, Vec B, int density, Vec normal){
+void MyViewer::generateEdgePoints(std::deque<SupportPoint> &points, Vec A, Vec B, int density, Vec normal) const {
     Vec v(A - B);
 
     for(size_t i = 0; i < density; ++i){
-        pointsToSupport.push_back(SupportPoint(B + i * (v / (density - 1)), MODEL, normal));
+        points.push_back(SupportPoint(B + i * (v / (density - 1)), MODEL, normal));
     }
 }
 
-void MyViewer::generateFacePoints(OpenMesh::SmartFaceHandle f){
-    std::vector<Vec> vertices;
-    for (auto v : f.vertices()){
-        vertices.push_back(vertexToVec(v));
-    }
-    Vec A(vertices[0]);
-    Vec B(vertices[1]);
-    Vec C(vertices[2]);
+void MyViewer::generateFacePoints(std::deque<SupportPoint> &points, OpenMesh::SmartFaceHandle f, double density) const {
+    const auto &geometry = *snapshot;
+    Vec A(geometry.point(geometry.vertex(f.idx(), 0)));
+    Vec B(geometry.point(geometry.vertex(f.idx(), 1)));
+    Vec C(geometry.point(geometry.vertex(f.idx(), 2)));
 
     Vec v1 = A - B;
     Vec v2 = C - B;
 
-    for(int i = gridDensity; i > 1; --i){
-        double delta = (i-1) / (gridDensity-1);
-        generateEdgePoints(B + v1 * delta, B + v2 * delta, i, Vec(mesh.normal(f).data()));
+    for(int i = density; i > 1; --i){
+        double delta = (i-1) / (density-1);
+        generateEdgePoints(points, B + v1 * delta, B + v2 * delta, i, Vec(geometry.normal(f.idx())));
     }
-    pointsToSupport.push_back(SupportPoint(B, MODEL, Vec(mesh.normal(f).data())));
+    points.push_back(SupportPoint(B, MODEL, Vec(geometry.normal(f.idx()))));
 }
 
 void MyViewer::generateCones(){
@@ -1051,15 +1989,16 @@ void MyViewer::generateCones(){
 }
 
 void MyViewer::drawTree(){
-    if (treePoints.empty()) calculateSupportTreePoints();
     glDisable(GL_LIGHTING);
     glPolygonMode(GL_FRONT, GL_LINES);
     glLineWidth(2.0);
     glColor3d(0.0, 1.0, 1.0);
     glBegin(GL_LINES);
-    for (auto tp : treePoints){
-        glVertex3dv(tp.point.location);
-        glVertex3dv(tp.nextPoint.location);
+    for (size_t i = 0; i < supportTree.size(); ++i){
+        if (supportTree.parents[i] < 0)
+            continue;
+        glVertex3dv(supportTree.positions[i]);
+        glVertex3dv(supportTree.positions[supportTree.parents[i]]);
     }
     glEnd();
     glLineWidth(1.0);
@@ -1067,214 +2006,1031 @@ void MyViewer::drawTree(){
 }
 
 void MyViewer::calculateSupportTreePoints(){
-    treePoints.clear();
-    getElementsThatNeedSupport();
-    calculatePointsToSupport();
-    double lowestZ;
-    if (!pointsToSupport.empty()) lowestZ  = pointsToSupport.back().location.z;
+    if (isBusy())
+        return;
+    runAsync(tr("Calculating tree points..."), [this]() -> Publish {
+        auto elements = std::make_shared<SupportElements>();
+        auto points = std::make_shared<std::deque<SupportPoint>>();
+        auto tree = std::make_shared<SupportTree>(computeSupportTree(*elements, *points));
+        if (cancel_requested)
+            return nullptr;
+        return [this, tree, elements, points]() {
+            std::swap(supportTree, *tree);
+            setSupportElements(*elements, *points);
+            strutFaces.clear(); // supportMesh belongs to the old tree
+            selected_support = -1;
+            axes.shown = false;
+        };
+    });
+}
+
+// Ranks orientations by estimated support volume in the background, and (optionally) applies the best
+void MyViewer::optimizeOrientation(bool apply){
+    if (model_type == ModelType::NONE || isBusy())
+        return;
+    auto points = std::make_shared<Orientation::PointVector>(mesh.n_vertices());
+    for (auto v : mesh.vertices())
+        (*points)[v.idx()] = Vector(mesh.point(v));
+    auto triangles = std::make_shared<std::vector<int>>(topology.faces);
+    runAsync(tr("Optimizing orientation..."), [this, points, triangles, apply]() -> Publish {
+        // Columns under the minima are struts of the smallest radius (1, see addStrut)
+        auto ranked = std::make_shared<std::vector<Orientation::Candidate>>(
+            Orientation::rank(*points, *triangles, angleLimit, M_PI));
+        if (cancel_requested || ranked->empty())
+            return nullptr;
+        return [this, ranked, apply]() {
+            orientations.swap(*ranked);
+            const auto &best = orientations.front();
+            double current = best.volume;
+            for (const auto &c : orientations)
+                if (c.up == Orientation::Vector3D(0.0, 0.0, 1.0))
+                    current = c.volume;
+            displayMessage(tr("Best orientation: estimated support volume %1 (currently %2), "
+                              "overhang area %3, %4 local minima")
+                           .arg(best.volume).arg(current).arg(best.overhang_area).arg(best.minima));
+            if (apply)
+                rotateModel(best.up);
+        };
+    });
+}
+
+// Runs in the background: only the mesh and its analysis (snapshot, height field) are read,
+// and the support elements and points it computes are returned.
+// Merges follow Vanek et al. (2014): every point has a downward cone of half-angle angleLimit,
+// and the pair of points whose cones intersect highest is merged first.
+// The best partner of a point is searched in a uniform XY grid, ring by ring,
+// stopping when no farther point can give a higher intersection.
+// Points that do not merge go to the nearest point of the model in their cone, or straight down
+// to the first surface below them (found by ray casting in the snapshot), or to the plate.
+// When a merge adds a point, the live points that can merge higher with it than their queued
+// event are revisited. Events are taken from a priority queue in horizontal layers: the points
+// of a layer that need a new event compute it in parallel, then the events are applied in order,
+// so the tree does not depend on the number of threads. Revisited points get their new events
+// in the next layer, so the merges are highest first only up to the layer height.
+MyViewer::SupportTree MyViewer::buildSupportTree(double angle, double density, bool progress,
+                                                   SupportElements &elements,
+                                                   std::deque<SupportPoint> &pointsToSupport){
+    SupportTree tree;
+    elements = findElementsThatNeedSupport(angle);
+    pointsToSupport = findPointsToSupport(elements.islands, density);
+    if (pointsToSupport.empty())
+        return tree;
+    tree.reserve(3 * pointsToSupport.size()); // a contact, its offset point and a merge or landing
+    const auto &geometry = *snapshot;
+    // The build plate is at the bottom of the model
+    double lowestZ = pointsToSupport.back().location.z;
+    for (size_t i = 0; i < geometry.n_points(); ++i)
+        lowestZ = std::min(lowestZ, geometry.point(i)[2]);
+    double highestZ = pointsToSupport.front().location.z;
+    // Thinner layers are closer to handling the events one by one
+    double layerHeight = (highestZ - lowestZ) / 100;
+    double t = tan(angle);
     double fullSize = pointsToSupport.size() * 2;
     int cnt = 0;
-    emit startComputation(tr("Calculating tree points..."));
-
-    while(!pointsToSupport.empty()){
-        emit midComputation(100 * (++cnt / fullSize));
-        SupportPoint p = pointsToSupport.front();
-        if (p.location.z > lowestZ){
-            SupportPoint closestFromPoints = getClosestPointFromPoints(p);
-            SupportPoint closestOnModel = getClosestPointOnModel(p);
-            Vec closestOnBase (p.location.x, p.location.y, lowestZ);
-            double distanceFromClosest = (p.location - closestFromPoints.location).norm();
-            double distanceFromModel = (p.location - closestOnModel.location).norm();
-            double distanceFromBase = (p.location - closestOnBase).norm();
-            Vec closest;
-
-            if (distanceFromClosest > 0.0 && distanceFromModel > 0.0){
-                if (distanceFromClosest < distanceFromBase && distanceFromClosest <= distanceFromModel) closest = closestFromPoints.location;
-                else if (distanceFromModel < distanceFromClosest && distanceFromModel < distanceFromBase) closest = closestOnModel.location;
-                else closest = closestOnBase;
-            } else if (distanceFromClosest == 0.0 && distanceFromModel > 0.0) {
-                if (distanceFromModel < distanceFromBase) closest = closestOnModel.location;
-                else closest = closestOnBase;
-            }  else if (distanceFromModel == 0.0 && distanceFromClosest > 0.0) {
-                if (distanceFromClosest < distanceFromBase) closest = closestFromPoints.location;
-                else closest = closestOnBase;
-            } else closest = closestOnBase;
-
-            if (p.type == locationType::MODEL){
-                if (p.location.z - lowestZ < 1.0) treePoints.push_back(TreePoint(p, SupportPoint(closestOnBase, COMMON)));
-                else treePoints.push_back(TreePoint(p, SupportPoint(p.location + p.normal.unit(), COMMON)));
-                pointsToSupport.push_back(SupportPoint(p.location + p.normal.unit(), COMMON));
-            } else if (pointsToSupport.size() > 1 && closest == closestFromPoints.location && closest != p.location)
-            {
-                Vec common = getCommonSupportPoint(p.location, closestFromPoints.location);
-                treePoints.push_back(TreePoint(p, SupportPoint(common, COMMON)));
-                treePoints.push_back(TreePoint(closestFromPoints, SupportPoint(common, COMMON)));
-                pointsToSupport.erase(std::find(pointsToSupport.begin(), pointsToSupport.end(), closestFromPoints));
-                pointsToSupport.push_back(SupportPoint(common, COMMON));
-            } else if (closest == closestOnModel.location && closest != p.location){
-                /*SupportPoint midpoint(closestOnModel.location - (closestOnModel.location-p.location).unit(), COMMON);
-                treePoints.push_back(TreePoint(p, midpoint));
-                treePoints.push_back(TreePoint(midpoint, closestOnModel));*/
-                treePoints.push_back(TreePoint(p, closestOnModel));
+
+    // Points on the model get a short strut along their normal first
+    std::vector<SupportPoint> nodes;
+    std::vector<int> treeNode; // of the nodes
+    std::vector<bool> alive;
+    for (const auto &p : pointsToSupport){
+        SupportPoint q = p;
+        int node;
+        if (p.type == locationType::MODEL){
+            q = SupportPoint(p.location + p.normal.unit(), COMMON);
+            node = tree.add(q);
+            if (p.location.z - lowestZ < 1.0) tree.add(p, tree.add(SupportPoint(Vec(p.location.x, p.location.y, lowestZ), COMMON)));
+            else tree.add(p, node);
+        } else
+            node = tree.add(q);
+        nodes.push_back(q);
+        treeNode.push_back(node);
+        alive.push_back(q.location.z > lowestZ); // points on the base need no support
+    }
+
+    // Uniform grid on the XY bounding box, with about one point per cell
+    double minX = nodes[0].location.x, maxX = minX, minY = nodes[0].location.y, maxY = minY;
+    for (const auto &p : nodes){
+        minX = std::min(minX, p.location.x); maxX = std::max(maxX, p.location.x);
+        minY = std::min(minY, p.location.y); maxY = std::max(maxY, p.location.y);
+    }
+    double cell = std::sqrt(std::max((maxX - minX) * (maxY - minY), 1.0e-12) / nodes.size());
+    cell = std::max(cell, std::max(maxX - minX, maxY - minY) / 1000.0);
+    int nx = (int)((maxX - minX) / cell) + 1, ny = (int)((maxY - minY) / cell) + 1;
+    std::vector<std::vector<size_t>> grid(nx * ny);
+    auto cellX = [&](double x) { return std::min(std::max((int)((x - minX) / cell), 0), nx - 1); };
+    auto cellY = [&](double y) { return std::min(std::max((int)((y - minY) / cell), 0), ny - 1); };
+    auto insert = [&](size_t i) { grid[cellY(nodes[i].location.y) * nx + cellX(nodes[i].location.x)].push_back(i); };
+    for (size_t i = 0; i < nodes.size(); ++i)
+        if (alive[i])
+            insert(i);
+
+    // Height of the highest common point of the cones at p and q (see getCommonSupportPoint)
+    auto mergeHeight = [&](const Vec &p, const Vec &q) {
+        double d = std::hypot(p.x - q.x, p.y - q.y);
+        if (d <= t * std::abs(p.z - q.z))
+            return std::min(p.z, q.z);
+        return (p.z + q.z) / 2 - d / (2 * t);
+    };
+
+    // Calls f(q) for the live points other than i, ring by ring around i, while the highest merge
+    // a point of the ring can give is above `limit()` (points in ring r are at least
+    // (r - 1) cells away horizontally)
+    auto visitRings = [&](size_t i, auto limit, auto f) {
+        const Vec &p = nodes[i].location;
+        int ci = cellX(p.x), cj = cellY(p.y);
+        for (int r = 0; r <= std::max(nx, ny); ++r){
+            double distance = std::max(r - 1, 0) * cell;
+            double bound = distance > 0 ? std::min(p.z, (p.z + highestZ) / 2 - distance / (2 * t)) : p.z;
+            if (bound <= limit())
+                break;
+            for (int j = cj - r; j <= cj + r; ++j){
+                if (j < 0 || j >= ny)
+                    continue;
+                int step = (j == cj - r || j == cj + r) ? 1 : 2 * r;
+                for (int k = ci - r; k <= ci + r; k += std::max(step, 1)){
+                    if (k < 0 || k >= nx)
+                        continue;
+                    for (size_t q : grid[j * nx + k])
+                        if (q != i && alive[q])
+                            f(q);
+                }
+            }
+        }
+    };
+
+    // The partner with the highest merge above the base, or i if there is none
+    auto bestPartner = [&](size_t i, double &height) {
+        size_t best = i;
+        height = lowestZ;
+        visitRings(i, [&]() { return height; }, [&](size_t q) {
+            double h = mergeHeight(nodes[i].location, nodes[q].location);
+            if (h > height || (h == height && best != i && q < best)){
+                best = q;
+                height = h;
+            }
+        });
+        return best;
+    };
+
+    enum Choice { TO_POINT, TO_MODEL, TO_BASE };
+    struct Event {
+        double height;
+        size_t point, other;  // other is used for TO_POINT
+        Choice choice;
+        unsigned version;     // of the point, to skip outdated events
+    };
+    auto lower = [](const Event &a, const Event &b) {
+        if (a.height != b.height) return a.height < b.height;
+        return a.point > b.point;
+    };
+    std::priority_queue<Event, std::vector<Event>, decltype(lower)> events(lower);
+    std::vector<unsigned> version(nodes.size(), 0);
+    std::vector<double> queued(nodes.size(), lowestZ); // height of the current event of each point
+    std::vector<SupportPoint> modelHit(nodes);  // the point itself when the model is not reached
+    std::vector<char> hitKnown(nodes.size(), false); // not vector<bool>, as it is written in parallel
+    // The first surface straight below, or the plate
+    std::vector<MeshSnapshot<Scalar>::RayHit> landing(nodes.size(), { -1, lowestZ });
+
+    auto decide = [&](size_t i) -> Event {
+        const SupportPoint &p = nodes[i];
+        double height;
+        size_t other = bestPartner(i, height);
+        double modelZ = modelHit[i] == p ? lowestZ : modelHit[i].location.z;
+        if (other != i && height >= std::max(modelZ, landing[i].z))
+            return { height, i, other, TO_POINT, version[i] };
+        if (modelZ > lowestZ && modelZ >= landing[i].z)
+            return { modelZ, i, i, TO_MODEL, version[i] };
+        return { landing[i].z, i, i, TO_BASE, version[i] };
+    };
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < nodes.size(); ++i)
+        if (alive[i])
+            pending.push_back(i);
+
+    while (!pending.empty() || !events.empty()){
+        if (cancel_requested)
+            return {};
+        if (progress)
+            reportProgress(100 * (cnt / fullSize));
+
+        // Landings of the new points, cast together; the height field tells which ones
+        // certainly have nothing below them, and land on the plate
+        std::vector<size_t> fresh;
+        std::vector<MeshSnapshot<Scalar>::Vector3D> origins;
+        for (size_t i : pending)
+            if (!hitKnown[i]){
+                const Vec &o = nodes[i].location;
+                if (height_field->below(o.x, o.y, o.z) == -std::numeric_limits<double>::infinity())
+                    landing[i] = { -1, lowestZ };
+                else {
+                    fresh.push_back(i);
+                    origins.emplace_back(o.x, o.y, o.z);
+                }
+            }
+        std::vector<MeshSnapshot<Scalar>::RayHit> hits;
+        geometry.castDown(origins, lowestZ, hits);
+        for (size_t k = 0; k < fresh.size(); ++k)
+            landing[fresh[k]] = hits[k];
+
+        // New events of the points that need them
+        std::vector<Event> computed(pending.size());
+        long n = pending.size(); // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(dynamic, 4)
+        for (long k = 0; k < n; ++k){
+            size_t i = pending[k];
+            if (!hitKnown[i]){
+                modelHit[i] = getClosestPointOnModel(nodes[i], angle);
+                hitKnown[i] = true;
+            }
+            computed[k] = decide(i);
+        }
+        for (const auto &e : computed){
+            events.push(e);
+            queued[e.point] = e.height;
+        }
+        pending.clear();
+        if (events.empty())
+            break;
+
+        double layerBottom = events.top().height - layerHeight;
+        while (!events.empty() && events.top().height >= layerBottom){
+            Event e = events.top();
+            events.pop();
+            size_t i = e.point;
+            if (!alive[i] || e.version != version[i])
+                continue;
+            const SupportPoint p = nodes[i];
+            if (e.choice == TO_POINT){
+                if (!alive[e.other]){
+                    ++version[i];
+                    pending.push_back(i);
+                    continue;
+                }
+                const SupportPoint q = nodes[e.other];
+                Vec common = getCommonSupportPoint(p.location, q.location, angle);
+                // When one point is inside the cone of the other, it carries on the branch
+                if (common == p.location){
+                    tree.parents[treeNode[e.other]] = treeNode[i];
+                    alive[e.other] = false;
+                    ++version[i];
+                    pending.push_back(i);
+                } else if (common == q.location){
+                    tree.parents[treeNode[i]] = treeNode[e.other];
+                    alive[i] = false;
+                } else {
+                    int merged = tree.add(SupportPoint(common, COMMON));
+                    tree.parents[treeNode[i]] = tree.parents[treeNode[e.other]] = merged;
+                    alive[i] = alive[e.other] = false;
+                    nodes.push_back(SupportPoint(common, COMMON));
+                    treeNode.push_back(merged);
+                    alive.push_back(true);
+                    version.push_back(0);
+                    queued.push_back(lowestZ);
+                    modelHit.push_back(nodes.back());
+                    hitKnown.push_back(false);
+                    landing.push_back({ -1, lowestZ });
+                    insert(nodes.size() - 1);
+                    pending.push_back(nodes.size() - 1);
+                    // Live points that can merge higher with the new point than their queued
+                    // event get a new one
+                    size_t m = nodes.size() - 1;
+                    visitRings(m, [&]() { return lowestZ; }, [&](size_t q) {
+                        if (mergeHeight(nodes[m].location, nodes[q].location) > queued[q]){
+                            ++version[q];
+                            queued[q] = std::numeric_limits<double>::max(); // until recomputed
+                            pending.push_back(q);
+                        }
+                    });
+                    ++cnt;
+                }
+            } else if (e.choice == TO_MODEL){
+                int contact = tree.add(modelHit[i]);
+                tree.parents[treeNode[i]] = contact;
+                alive[i] = false;
             } else {
-                treePoints.push_back(TreePoint(p, SupportPoint(closest, PLATE)));
+                Vec below(p.location.x, p.location.y, landing[i].z);
+                int end;
+                if (landing[i].face >= 0)
+                    end = tree.add(SupportPoint(below, MODEL, Vec(geometry.normal(landing[i].face))));
+                else
+                    end = tree.add(SupportPoint(below, PLATE));
+                tree.parents[treeNode[i]] = end;
+                alive[i] = false;
             }
+            ++cnt;
         }
-        pointsToSupport.pop_front();
-        sortPointsToSupport();
+        std::sort(pending.begin(), pending.end());
+        pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
     }
-    emit endComputation();
-    update();
+    tree.link();
+    return tree;
 }
 
-MyViewer::SupportPoint MyViewer::getClosestPointFromPoints(SupportPoint p){
-    if (pointsToSupport.size() <= 1)
-        return p;
-    else {
-        SupportPoint closest = pointsToSupport[1];
-        for(size_t i = 1; i < pointsToSupport.size(); ++i){
-            if ( (pointsToSupport[i].location - p.location).norm() < (closest.location - p.location).norm()
-                && angleOfVectors(pointsToSupport[i].location - p.location, Vec(pointsToSupport[i].location.x, pointsToSupport[i].location.y, p.location.z) - p.location) < degToRad(90) - angleLimit)
-                closest = pointsToSupport[i];
+// The tree of the cache, or a new one, which is then cached
+MyViewer::SupportTree MyViewer::computeSupportTree(SupportElements &elements,
+                                                   std::deque<SupportPoint> &points){
+    SupportTree tree;
+    QString cacheFile = supportTreeCacheFile();
+    if (loadSupportTree(cacheFile, tree)) {
+        // Only the tree is cached
+        elements = findElementsThatNeedSupport(angleLimit);
+        points = findPointsToSupport(elements.islands, gridDensity);
+        return tree;
+    }
+    tree = buildSupportTree(angleLimit, gridDensity, true, elements, points);
+    if (!cancel_requested)
+        saveSupportTree(cacheFile, tree);
+    return tree;
+}
+
+// On the GUI thread, from the Publish step of the computation
+void MyViewer::setSupportElements(SupportElements &elements, std::deque<SupportPoint> &points){
+    facesToSupport.swap(elements.faces);
+    edgesToSupport.swap(elements.edges);
+    verticesToSupport.swap(elements.vertices);
+    overhangIslands.swap(elements.islands);
+    pointsToSupport.swap(points);
+}
+
+// Cached tree files start with this magic string (with a version, also changed when the trees
+// of the algorithm change, as it is part of the cache key), followed by the number
+// of nodes, then the location, type and normal of each node as doubles, and finally their parents
+// as 32-bit integers (all in native byte order)
+static const char supportTreeMagic[8] = { 'S', 'U', 'P', 'T', 'R', 'E', 'E', '3' };
+static const size_t supportTreeRecord = 7;
+
+// The cache file of the tree for the current geometry and support parameters
+QString MyViewer::supportTreeCacheFile() const {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(supportTreeMagic, sizeof(supportTreeMagic));
+    hash.addData(reinterpret_cast<const char *>(mesh.points()),
+                 (int)(mesh.n_vertices() * sizeof(MyMesh::Point)));
+    hash.addData(reinterpret_cast<const char *>(topology.faces.data()),
+                 (int)(topology.faces.size() * sizeof(int)));
+    double parameters[] = { angleLimit, gridDensity, diameterCoefficient };
+    hash.addData(reinterpret_cast<const char *>(parameters), sizeof(parameters));
+    return cacheDirectory("support-trees") + "/" + QString(hash.result().toHex()) + ".tree";
+}
+
+bool MyViewer::loadSupportTree(const QString &filename, SupportTree &tree) {
+    std::ifstream f(filename.toStdString(), std::ios::binary);
+    char magic[sizeof(supportTreeMagic)];
+    uint64_t count;
+    if (!f.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), supportTreeMagic) ||
+        !f.read(reinterpret_cast<char *>(&count), sizeof(count)))
+        return false;
+    auto start = f.tellg();
+    f.seekg(0, std::ios::end);
+    if ((uint64_t)(f.tellg() - start) != count * (supportTreeRecord * sizeof(double) + sizeof(int32_t)))
+        return false; // truncated or damaged
+    f.seekg(start);
+    std::vector<double> data(count * supportTreeRecord);
+    std::vector<int32_t> parents(count);
+    if (!f.read(reinterpret_cast<char *>(data.data()), data.size() * sizeof(double)) ||
+        !f.read(reinterpret_cast<char *>(parents.data()), parents.size() * sizeof(int32_t)))
+        return false;
+    for (size_t i = 0; i < count; ++i)
+        if (parents[i] < -1 || parents[i] >= (int64_t)count || parents[i] == (int64_t)i)
+            return false;
+    tree.clear();
+    tree.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const double *d = &data[i * supportTreeRecord];
+        tree.add(SupportPoint(Vec(d[0], d[1], d[2]), (locationType)(int)d[3], Vec(d[4], d[5], d[6])),
+                 parents[i]);
+    }
+    tree.link();
+    return true;
+}
+
+void MyViewer::saveSupportTree(const QString &filename, const SupportTree &tree) {
+    std::vector<double> data;
+    data.reserve(tree.size() * supportTreeRecord);
+    for (size_t i = 0; i < tree.size(); ++i) {
+        const Vec &p = tree.positions[i], &n = tree.normals[i];
+        data.insert(data.end(), { p.x, p.y, p.z, (double)tree.types[i], n.x, n.y, n.z });
+    }
+    std::vector<int32_t> parents(tree.parents.begin(), tree.parents.end());
+    // Written under a temporary name first, so that a partial file is never read
+    std::string temporary = filename.toStdString() + ".part";
+    uint64_t count = tree.size();
+    {
+        std::ofstream f(temporary, std::ios::binary);
+        f.write(supportTreeMagic, sizeof(supportTreeMagic));
+        f.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        f.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(double));
+        f.write(reinterpret_cast<const char *>(parents.data()), parents.size() * sizeof(int32_t));
+        if (!f)
+            return;
+    }
+    QFile::remove(filename);
+    QFile::rename(QString::fromStdString(temporary), filename);
+}
+
+void MyViewer::SupportTree::clear() {
+    positions.clear();
+    normals.clear();
+    types.clear();
+    parents.clear();
+    child_offsets.clear();
+    children.clear();
+    grid.cells.clear();
+}
+
+void MyViewer::SupportTree::reserve(size_t n) {
+    positions.reserve(n);
+    normals.reserve(n);
+    types.reserve(n);
+    parents.reserve(n);
+}
+
+int MyViewer::SupportTree::add(const SupportPoint &p, int parent) {
+    positions.push_back(p.location);
+    normals.push_back(p.normal);
+    types.push_back(p.type);
+    parents.push_back(parent);
+    if (!grid.cells.empty() && p.type == COMMON)
+        insertIntoGrid(positions.size() - 1);
+    return positions.size() - 1;
+}
+
+void MyViewer::SupportTree::link() {
+    size_t n = size();
+    child_offsets.assign(n + 1, 0);
+    for (auto p : parents)
+        if (p >= 0)
+            ++child_offsets[p+1];
+    std::partial_sum(child_offsets.begin(), child_offsets.end(), child_offsets.begin());
+    children.resize(child_offsets[n]);
+    std::vector<int> next(child_offsets.begin(), child_offsets.end() - 1);
+    for (size_t i = 0; i < n; ++i)
+        if (parents[i] >= 0)
+            children[next[parents[i]]++] = i;
+}
+
+std::vector<int> MyViewer::SupportTree::rootsFirst() const {
+    std::vector<int> order;
+    order.reserve(size());
+    for (size_t i = 0; i < size(); ++i)
+        if (parents[i] < 0)
+            order.push_back(i);
+    for (size_t k = 0; k < order.size(); ++k)
+        for (int j = child_offsets[order[k]]; j < child_offsets[order[k]+1]; ++j)
+            order.push_back(children[j]);
+    return order;
+}
+
+std::vector<int> MyViewer::SupportTree::remove(const std::vector<char> &removed) {
+    std::vector<int> index(size(), -1);
+    size_t n = 0;
+    for (size_t i = 0; i < size(); ++i)
+        if (!removed[i]) {
+            positions[n] = positions[i];
+            normals[n] = normals[i];
+            types[n] = types[i];
+            parents[n] = parents[i];
+            index[i] = n++;
+        }
+    positions.resize(n);
+    normals.resize(n);
+    types.resize(n);
+    parents.resize(n);
+    for (auto &p : parents)
+        if (p >= 0)
+            p = index[p];
+    link();
+    for (auto &nodes : grid.cells) {
+        size_t kept = 0;
+        for (int q : nodes)
+            if (index[q] >= 0)
+                nodes[kept++] = index[q];
+        nodes.resize(kept);
+    }
+    return index;
+}
+
+void MyViewer::SupportTree::move(int i, const Vec &p) {
+    if (!grid.cells.empty() && types[i] == COMMON) {
+        auto &nodes = grid.cells[grid.cellY(positions[i].y) * grid.nx + grid.cellX(positions[i].x)];
+        nodes.erase(std::find(nodes.begin(), nodes.end(), i));
+        positions[i] = p;
+        insertIntoGrid(i);
+    } else
+        positions[i] = p;
+}
+
+void MyViewer::SupportTree::buildGrid() {
+    grid.cells.clear();
+    std::vector<int> nodes;
+    for (size_t i = 0; i < size(); ++i)
+        if (types[i] == COMMON)
+            nodes.push_back(i);
+    if (nodes.empty())
+        return;
+    const Vec &first = positions[nodes[0]];
+    double minX = first.x, maxX = minX, minY = first.y, maxY = minY;
+    grid.lowest = first.z;
+    for (int i : nodes) {
+        const Vec &p = positions[i];
+        minX = std::min(minX, p.x); maxX = std::max(maxX, p.x);
+        minY = std::min(minY, p.y); maxY = std::max(maxY, p.y);
+        grid.lowest = std::min(grid.lowest, p.z);
+    }
+    // With a margin for the nodes of later edits
+    double margin = std::max(std::max(maxX - minX, maxY - minY) / 8, 1.0);
+    grid.minX = minX - margin; grid.maxX = maxX + margin;
+    grid.minY = minY - margin; grid.maxY = maxY + margin;
+    double width = grid.maxX - grid.minX, height = grid.maxY - grid.minY;
+    grid.cell = std::max(std::sqrt(width * height / nodes.size()), std::max(width, height) / 1000.0);
+    grid.nx = (int)(width / grid.cell) + 1;
+    grid.ny = (int)(height / grid.cell) + 1;
+    grid.cells.resize(grid.nx * grid.ny);
+    for (int i : nodes)
+        grid.cells[grid.cellY(positions[i].y) * grid.nx + grid.cellX(positions[i].x)].push_back(i);
+}
+
+void MyViewer::SupportTree::insertIntoGrid(int i) {
+    const Vec &p = positions[i];
+    if (p.x < grid.minX || p.x > grid.maxX || p.y < grid.minY || p.y > grid.maxY) {
+        grid.cells.clear(); // rebuilt by the next query
+        return;
+    }
+    grid.lowest = std::min(grid.lowest, p.z);
+    grid.cells[grid.cellY(p.y) * grid.nx + grid.cellX(p.x)].push_back(i);
+}
+
+// Ring by ring around the cell of the apex; nodes in ring r are at least (r - 1) cells away
+// horizontally, so they are not higher than apex.z - (r - 1) * cell / t in the cone
+int MyViewer::SupportTree::highestInCone(const Vec &apex, double t, int except) {
+    if (grid.cells.empty())
+        buildGrid();
+    if (grid.cells.empty())
+        return -1;
+    int best = -1;
+    int ci = grid.cellX(apex.x), cj = grid.cellY(apex.y);
+    for (int r = 0; r <= std::max(grid.nx, grid.ny); ++r) {
+        double top = apex.z - std::max(r - 1, 0) * grid.cell / t;
+        if (top < grid.lowest || (best >= 0 && top < positions[best].z))
+            break;
+        for (int j = cj - r; j <= cj + r; ++j) {
+            if (j < 0 || j >= grid.ny)
+                continue;
+            int step = (j == cj - r || j == cj + r) ? 1 : 2 * r;
+            for (int k = ci - r; k <= ci + r; k += std::max(step, 1)) {
+                if (k < 0 || k >= grid.nx)
+                    continue;
+                for (int i : grid.cells[j * grid.nx + k]) {
+                    const Vec &q = positions[i];
+                    if (i == except || q.z >= apex.z || std::hypot(q.x - apex.x, q.y - apex.y) > t * (apex.z - q.z))
+                        continue;
+                    if (best < 0 || q.z > positions[best].z || (q.z == positions[best].z && i < best))
+                        best = i;
+                }
+            }
         }
-        if (angleOfVectors(closest.location - p.location, Vec(closest.location.x, closest.location.y, p.location.z) - p.location) > degToRad(90) - angleLimit)
-            return p;
-        return closest;
     }
+    return best;
 }
 
-Vec MyViewer::getCommonSupportPoint(Vec p1, Vec p2){
-    Vec normal = ((p2 - p1).unit() ^ Vec(0.0, 0.0, 1.0)).unit();
-    Vec fromp1 = rotateAround(Vec(p1.x, p1.y, 0.0) - p1, normal, angleLimit);
-    Vec fromp2 = rotateAround(Vec(p2.x, p2.y, 0.0) - p2, normal, -angleLimit);
-    return intersectLines(p1, fromp1, p2, fromp2);
+// The highest point of the intersection of the downward cones at p1 and p2;
+// it lies in the vertical plane through both apexes
+Vec MyViewer::getCommonSupportPoint(Vec p1, Vec p2, double angle) const {
+    if (p1.z < p2.z)
+        std::swap(p1, p2);
+    Vec dir(p2.x - p1.x, p2.y - p1.y, 0.0);
+    double d = dir.norm(), t = tan(angle);
+    if (d <= t * (p1.z - p2.z))
+        return p2; // inside the cone of p1
+    double a = (d + t * (p1.z - p2.z)) / 2; // horizontal distance from p1
+    return p1 + dir * (a / d) - Vec(0.0, 0.0, a / t);
 }
 
-MyViewer::SupportPoint MyViewer::getClosestPointOnModel(MyViewer::SupportPoint p){
+MyViewer::SupportPoint MyViewer::getClosestPointOnModel(MyViewer::SupportPoint p, double angle) const {
+    const auto &geometry = *snapshot;
+    const auto &field = *height_field;
+    MeshSnapshot<Scalar>::Vector3D location(p.location.x, p.location.y, p.location.z);
     Vec closest;
     bool closestSet = false;
     Vec normal;
-    for(auto f: mesh.faces()){
-            Vec projection = projectToTriangle(p.location, f);
+    // The accepted points are in the downward cone at p, so a point at a horizontal distance r
+    // is lower than p.z - r / t. Blocks and cells with nothing that low are skipped, and so are
+    // those that cannot hold a closer point than the best one so far (by their XY distance and
+    // the height of their faces); the rings stop where no better point can be, or below the model.
+    double t = tan(angle);
+    double reach = (p.location.z - field.lowest()) * t;
+    double best = std::numeric_limits<double>::max();
+    auto hopeless = [&](double distance, double top) {
+        return closestSet && std::hypot(distance, p.location.z - top) >= best;
+    };
+    // The faces of a cell that pass these tests are projected in batches, by the vectorized kernel
+    const size_t batch = 16;
+    int faces[batch];
+    MeshSnapshot<Scalar>::Vector3D projections[batch];
+    size_t count = 0;
+    auto project = [&]() {
+        geometry.closestPoints(faces, count, location, projections);
+        for (size_t k = 0; k < count; ++k) {
+            Vec projection(projections[k]);
             if ( projection.z < p.location.z
-                && angleOfVectors(projection - p.location, Vec(projection.x, projection.y, p.location.z) - p.location) > degToRad(90)-angleLimit
-                && (!closestSet
-                    || (projection - p.location).norm() < (closest - p.location).norm())){
+                && angleOfVectors(projection - p.location, Vec(projection.x, projection.y, p.location.z) - p.location) > degToRad(90)-angle
+                && (!closestSet || (projection - p.location).norm() < best)){
                 closest = projection;
-                normal = Vec(mesh.normal(f).data());
+                best = (closest - p.location).norm();
+                normal = Vec(geometry.normal(faces[k]));
                 closestSet = true;
             }
-    }
+        }
+        count = 0;
+    };
+    field.around(p.location.x, p.location.y,
+                 [&](double distance) { return distance <= reach && !(closestSet && distance > best * sin(angle)); },
+                 [&](double bottom, double top, double distance) {
+                     double zLimit = p.location.z - distance / t;
+                     return bottom < zLimit && !hopeless(distance, std::min(top, zLimit));
+                 },
+                 [&](size_t i, size_t j) {
+                     double distance = field.distance(p.location.x, p.location.y, i, j);
+                     double zLimit = p.location.z - distance / t;
+                     if (!field.reaches(i, j, zLimit))
+                         return;
+                     for(auto e = field.entriesBegin(i, j); e != field.entriesEnd(i, j) && e->bottom < zLimit; ++e){
+                         if (hopeless(distance, std::min(e->top, zLimit)))
+                             continue;
+                         faces[count++] = e->face;
+                         if (count == batch)
+                             project();
+                     }
+                     project();
+                 });
     if (closestSet) return SupportPoint(closest, MODEL, normal);
     return p;
 }
 
-Vec MyViewer::projectToTriangle(const Vec &p, const OpenMesh::SmartFaceHandle &f) {
-    std::vector<Vec> vertices;
-    for (auto v : f.vertices()){
-        vertices.push_back(vertexToVec(v));
-    }
-    const Vec &q1 = vertices[0], &q2 = vertices[1], &q3 = vertices[2];
-    // As in Schneider, Eberly: Geometric Tools for Computer Graphics, Morgan Kaufmann, 2003.
-    // Section 10.3.2, pp. 376-382 (with my corrections)
-    const Vec &P = p, &B = q1;
-    Vec E0 = q2 - q1, E1 = q3 - q1, D = B - P;
-    double a = E0 * E0, b = E0 * E1, c = E1 * E1, d = E0 * D, e = E1 * D;
-    double det = a * c - b * b, s = b * e - c * d, t = b * d - a * e;
-    if (s + t <= det) {
-        if (s < 0) {
-            if (t < 0) {
-                // Region 4
-                if (e < 0) {
-                    s = 0.0;
-                    t = (-e >= c ? 1.0 : -e / c);
-                } else if (d < 0) {
-                    t = 0.0;
-                    s = (-d >= a ? 1.0 : -d / a);
-                } else {
-                    s = 0.0;
-                    t = 0.0;
-                }
-            } else {
-                // Region 3
-                s = 0.0;
-                t = (e >= 0.0 ? 0.0 : (-e >= c ? 1.0 : -e / c));
+bool MyViewer::isSupportContact(int i) const {
+    return i >= 0 && i < (int)supportTree.size() && supportTree.types[i] == MODEL && supportTree.parents[i] >= 0
+        && supportTree.child_offsets[i] == supportTree.child_offsets[i+1];
+}
+
+// A new contact at the point of the model closest to `location`, with a short strut along the normal
+// as in buildSupportTree, and a branch from there down to the tree, the model or the plate
+int MyViewer::addSupportPoint(const Vec &location){
+    if (model_type == ModelType::NONE || isBusy() || !snapshot)
+        return -1;
+    SupportPoint p = snapToModel(location);
+    double lowestZ = height_field->lowest();
+    size_t first = supportTree.size();
+    int contact;
+    if (p.location.z - lowestZ < 1.0){
+        int base = supportTree.add(SupportPoint(Vec(p.location.x, p.location.y, lowestZ), COMMON));
+        contact = supportTree.add(p, base);
+    } else {
+        int node = supportTree.add(SupportPoint(p.location + p.normal.unit(), COMMON));
+        contact = supportTree.add(p, node);
+        routeBranch(node);
+    }
+    supportTree.link();
+    addEditedStruts(first);
+    return contact;
+}
+
+// While dragging, only the contact follows `location` on the model, with the point of its short strut
+// (when not shared) placed as by addSupportPoint; the rest of the branch stays, until moveSupportPoint
+// routes it again at the end of the drag. The faces of the two struts are updated in place.
+void MyViewer::dragSupportPoint(int contact, const Vec &location){
+    if (isBusy() || !isSupportContact(contact))
+        return;
+    auto &tree = supportTree;
+    SupportPoint p = snapToModel(location);
+    tree.move(contact, p.location);
+    tree.normals[contact] = p.normal;
+    std::vector<int> edited = { contact };
+    int node = tree.parents[contact];
+    if (tree.types[node] == COMMON && tree.child_offsets[node+1] - tree.child_offsets[node] == 1) {
+        if (tree.parents[node] < 0)
+            tree.move(node, Vec(p.location.x, p.location.y, tree.positions[node].z)); // on the plate
+        else
+            tree.move(node, p.location + p.normal.unit());
+        edited.push_back(node);
+    }
+    if (strutFaces.size() != tree.size())
+        return;
+    for (int i : edited) {
+        auto &faces = strutFaces[i];
+        MyMesh strut;
+        addNodeStrut(strut, tree, i);
+        if ((int)strut.n_faces() == faces.second - faces.first) {
+            for (int f = faces.first; f < faces.second; ++f) {
+                auto to = supportMesh.fv_begin(MyMesh::FaceHandle(f));
+                for (auto v : strut.fv_range(MyMesh::FaceHandle(f - faces.first)))
+                    supportMesh.set_point(*to++, strut.point(v));
             }
-        } else if (t < 0) {
-            // Region 5
-            t = 0.0;
-            s = (d >= 0.0 ? 0.0 : (-d >= a ? 1.0 : -d / a));
         } else {
-            // Region 0
-            double invDet = 1.0 / det;
-            s *= invDet;
-            t *= invDet;
+            // Degenerate before or after the move: new faces, the old ones are dropped by compactStruts
+            for (int f = faces.first; f < faces.second; ++f)
+                supportMesh.delete_face(MyMesh::FaceHandle(f), true);
+            faces = addNodeStrut(supportMesh, tree, i);
         }
-    } else {
-        if (s < 0) {
-            // Region 2
-            double tmp0 = b + d, tmp1 = c + e;
-            if (tmp1 > tmp0) {
-                double numer = tmp1 - tmp0;
-                double denom = a - 2 * b + c;
-                s = (numer >= denom ? 1.0 : numer / denom);
-                t = 1.0 - s;
-            } else {
-                s = 0.0;
-                t = (tmp1 <= 0.0 ? 1.0 : (e >= 0.0 ? 0.0 : -e / c));
-            }
-        } else if (t < 0) {
-            // Region 6
-            double tmp0 = b + e, tmp1 = a + d;
-            if (tmp1 > tmp0) {
-                double numer = tmp1 - tmp0;
-                double denom = c - 2 * b + a;
-                t = (numer >= denom ? 1.0 : numer / denom);
-                s = 1.0 - t;
-            } else {
-                t = 0.0;
-                s = (tmp1 <= 0.0 ? 1.0 : (d >= 0.0 ? 0.0 : -d / a));
+        setStrutNormals(faces);
+    }
+}
+
+int MyViewer::moveSupportPoint(int contact, const Vec &location){
+    if (isBusy() || !isSupportContact(contact))
+        return -1;
+    removeSupportPoint(contact);
+    return addSupportPoint(location);
+}
+
+// The contact goes with its branch, down to where it meets another one
+void MyViewer::removeSupportPoint(int contact){
+    if (isBusy() || !isSupportContact(contact))
+        return;
+    auto &tree = supportTree;
+    std::vector<char> removed(tree.size(), false);
+    for (int i = contact; ; i = tree.parents[i]){
+        removed[i] = true;
+        int parent = tree.parents[i];
+        if (parent < 0 || tree.child_offsets[parent+1] - tree.child_offsets[parent] > 1)
+            break;
+    }
+    bool geometry = strutFaces.size() == tree.size();
+    std::vector<int> index = tree.remove(removed);
+    if (!geometry)
+        return;
+    for (size_t i = 0; i < index.size(); ++i) {
+        if (index[i] >= 0)
+            strutFaces[index[i]] = strutFaces[i];
+        else
+            for (int f = strutFaces[i].first; f < strutFaces[i].second; ++f)
+                supportMesh.delete_face(MyMesh::FaceHandle(f), true);
+    }
+    strutFaces.resize(tree.size());
+}
+
+// The closest point of the model, searched in the cells of the height field ring by ring
+MyViewer::SupportPoint MyViewer::snapToModel(const Vec &location) const {
+    const auto &geometry = *snapshot;
+    const auto &field = *height_field;
+    MeshSnapshot<Scalar>::Vector3D l(location.x, location.y, location.z);
+    double best = std::numeric_limits<double>::max();
+    Vec closest = location, normal(0.0, 0.0, 1.0);
+    // A block or cell at XY distance d, with faces from `bottom` to `top`, holds no point closer than this
+    auto bound = [&](double d, double bottom, double top) {
+        double dz = std::max(std::max(bottom - location.z, location.z - top), 0.0);
+        return std::hypot(d, dz);
+    };
+    // The faces of a cell within the bound are projected in batches, by the vectorized kernel
+    const size_t batch = 16;
+    int faces[batch];
+    MeshSnapshot<Scalar>::Vector3D projections[batch];
+    size_t count = 0;
+    auto project = [&]() {
+        geometry.closestPoints(faces, count, l, projections);
+        for (size_t k = 0; k < count; ++k) {
+            Vec q(projections[k]);
+            if ((q - location).norm() < best){
+                best = (q - location).norm();
+                closest = q;
+                normal = Vec(geometry.normal(faces[k]));
             }
-        } else {
-            // Region 1
-            double numer = c + e - b - d;
-            if (numer <= 0) {
-                s = 0;
-            } else {
-                double denom = a - 2 * b + c;
-                s = (numer >= denom ? 1.0 : numer / denom);
+        }
+        count = 0;
+    };
+    field.around(location.x, location.y,
+                 [&](double distance) { return distance <= best; },
+                 [&](double bottom, double top, double distance) { return bound(distance, bottom, top) < best; },
+                 [&](size_t i, size_t j) {
+                     double distance = field.distance(location.x, location.y, i, j);
+                     if (distance > best)
+                         return;
+                     for (auto e = field.entriesBegin(i, j); e != field.entriesEnd(i, j); ++e){
+                         if (bound(distance, e->bottom, e->top) >= best)
+                             continue;
+                         faces[count++] = e->face;
+                         if (count == batch)
+                             project();
+                     }
+                     project();
+                 });
+    return SupportPoint(closest, MODEL, normal);
+}
+
+// Continues the branch from `node` with the choices of buildSupportTree: a point of the tree below it
+// (inside its cone, where branches are joined without new merge points), the model or the plate,
+// whichever is the highest
+void MyViewer::routeBranch(int node){
+    auto &tree = supportTree;
+    const SupportPoint p = tree.node(node);
+    double lowestZ = height_field->lowest(), t = tan(angleLimit);
+    int join = tree.highestInCone(p.location, t, node);
+    SupportPoint hit = getClosestPointOnModel(p, angleLimit);
+    double modelZ = hit == p ? lowestZ : hit.location.z;
+    MeshSnapshot<Scalar>::RayHit landing = { -1, lowestZ };
+    if (height_field->below(p.location.x, p.location.y, p.location.z) != -std::numeric_limits<double>::infinity())
+        landing = snapshot->castDown(MeshSnapshot<Scalar>::Vector3D(p.location.x, p.location.y, p.location.z),
+                                     lowestZ);
+    int end;
+    if (join >= 0 && tree.positions[join].z >= std::max(modelZ, landing.z))
+        end = join;
+    else if (modelZ > lowestZ && modelZ >= landing.z)
+        end = tree.add(hit);
+    else {
+        Vec below(p.location.x, p.location.y, landing.z);
+        if (landing.face >= 0)
+            end = tree.add(SupportPoint(below, MODEL, Vec(snapshot->normal(landing.face))));
+        else
+            end = tree.add(SupportPoint(below, PLATE));
+    }
+    tree.parents[node] = end;
+}
+
+// Struts of the new nodes, when supportMesh is the geometry of the tree
+void MyViewer::addEditedStruts(size_t first){
+    if (strutFaces.size() != first)
+        return;
+    int firstFace = supportMesh.n_faces();
+    for (size_t i = first; i < supportTree.size(); ++i)
+        strutFaces.push_back(addNodeStrut(supportMesh, supportTree, i));
+    setStrutNormals({ firstFace, (int)supportMesh.n_faces() });
+}
+
+// Every face has its own vertices, which get its normal
+void MyViewer::setStrutNormals(const std::pair<int,int> &faces){
+    for (int f = faces.first; f < faces.second; ++f){
+        MyMesh::FaceHandle fh(f);
+        supportMesh.set_normal(fh, supportMesh.calc_face_normal(fh));
+        for (auto v : supportMesh.fv_range(fh))
+            supportMesh.set_normal(v, supportMesh.normal(fh));
+    }
+}
+
+// Rebuilds supportMesh from the live struts, in the order of the nodes. (garbage_collection would
+// fill the holes with the last faces, so the struts would no longer be face ranges.)
+void MyViewer::compactStruts(){
+    bool deleted = false; // the face iterators skip deleted faces
+    for (int f = 0; f < (int)supportMesh.n_faces() && !deleted; ++f)
+        deleted = supportMesh.status(MyMesh::FaceHandle(f)).deleted();
+    if (strutFaces.empty() || !deleted)
+        return;
+    MyMesh compact;
+    compact.request_face_normals(); compact.request_halfedge_normals(); compact.request_vertex_normals();
+    compact.request_face_status(); compact.request_edge_status();
+    compact.request_halfedge_status(); compact.request_vertex_status();
+    for (auto &range : strutFaces) {
+        int first = compact.n_faces();
+        for (int f = range.first; f < range.second; ++f) {
+            MyMesh::FaceHandle fh(f);
+            std::vector<MyMesh::VertexHandle> vertices;
+            for (auto v : supportMesh.fv_range(fh)) {
+                vertices.push_back(compact.add_vertex(supportMesh.point(v)));
+                compact.set_normal(vertices.back(), supportMesh.normal(v));
             }
-            t  = 1.0 - s;
+            compact.set_normal(compact.add_face(vertices), supportMesh.normal(fh));
         }
+        range = { first, (int)compact.n_faces() };
     }
-    return B + E0 * s + E1 * t;
+    supportMesh = std::move(compact);
 }
 
 void MyViewer::addTreeGeometry(){
+    if (isBusy())
+        return;
     showWhereSupportNeeded = false;
-    update();
-    if (treePoints.empty()) calculateSupportTreePoints();
-    supportMesh.clear();
-    emit startComputation(tr("Generating tree..."));
-    double counter = 0.0;
-    for(auto t : treePoints){
-        emit midComputation(100 * counter/treePoints.size());
-        if (t.point.location != t.nextPoint.location) addStrut(t.point, t.nextPoint);
-        counter += 1.0;
+    auto tree = std::make_shared<SupportTree>(supportTree);
+    runAsync(tr("Generating tree..."), [this, tree]() -> Publish {
+        bool computed = tree->empty();
+        auto elements = std::make_shared<SupportElements>();
+        auto points = std::make_shared<std::deque<SupportPoint>>();
+        if (computed) *tree = computeSupportTree(*elements, *points);
+        auto geometry = std::make_shared<MyMesh>();
+        geometry->request_face_normals(); geometry->request_halfedge_normals(); geometry->request_vertex_normals();
+        geometry->request_face_status(); geometry->request_edge_status();
+        geometry->request_halfedge_status(); geometry->request_vertex_status();
+        auto faces = std::make_shared<std::vector<std::pair<int,int>>>(tree->size());
+        for(size_t i = 0; i < tree->size(); ++i){
+            if (cancel_requested)
+                return nullptr;
+            reportProgress(100 * i / tree->size());
+            (*faces)[i] = addNodeStrut(*geometry, *tree, i);
+        }
+        geometry->update_normals();
+        return [this, tree, elements, points, geometry, faces, computed]() {
+            if (computed) {
+                std::swap(supportTree, *tree);
+                setSupportElements(*elements, *points);
+            }
+            supportMesh = std::move(*geometry);
+            strutFaces.swap(*faces);
+            selected_support = -1;
+            axes.shown = false;
+        };
+    });
+}
+
+
+
+MyViewer::SupportEstimate MyViewer::estimateSupport() const {
+    return estimateSupport(diameterCoefficient);
+}
+
+MyViewer::SupportEstimate MyViewer::estimateSupport(double coefficient) const {
+    return estimateSupport(supportTree, coefficient);
+}
+
+MyViewer::SupportEstimate MyViewer::estimateSupport(const SupportTree &tree, double coefficient) const {
+    SupportEstimate result = { 0, 0, 0.0, 0.0, 0.0, 0.0 };
+    // Height where the branch of each node ends, passed on from the roots
+    std::vector<double> bottom(tree.size());
+    for (int i : tree.rootsFirst())
+        bottom[i] = tree.parents[i] < 0 ? tree.positions[i].z : bottom[tree.parents[i]];
+
+    for (size_t i = 0; i < tree.size(); ++i) {
+        int parent = tree.parents[i];
+        if (parent < 0)
+            continue;
+        Vec top = tree.positions[i], end = tree.positions[parent];
+        if (top == end)
+            continue; // not built by addTreeGeometry either
+        double length = (top - end).norm(), r = strutRadius(top, end, coefficient);
+        ++result.struts;
+        result.contacts += (tree.types[i] == MODEL) + (tree.types[parent] == MODEL);
+        // Struts are triangular prisms with horizontal ends, inscribed in a circle of radius r,
+        // except those with a contact at the top, which are pyramids ending in the contact
+        double prism = 3.0 * std::sqrt(3.0) / 4.0 * r * r * std::abs(top.z - end.z);
+        result.volume += tree.types[i] == MODEL ? prism / 3.0 : prism;
+        result.total_length += length;
+        result.longest_strut = std::max(result.longest_strut, length);
+        result.tallest_column = std::max(result.tallest_column, top.z - bottom[i]);
     }
-    supportMesh.update_normals();
-    emit endComputation();
+    return result;
 }
 
+// The mesh analysis (snapshot, height field) is shared by all combinations.
+// The trees of the angles and densities are built in parallel (each one on a single thread,
+// as nested parallel regions are serialized) when there are at least as many as threads,
+// otherwise one by one, each with all threads. Then all coefficients are estimated in parallel
+// on them. The parameters, the tree and the support overlays of the viewer are not changed.
+std::vector<MyViewer::SweepResult> MyViewer::sweepSupport(const std::vector<double> &angles,
+                                                          const std::vector<double> &densities,
+                                                          const std::vector<double> &coefficients) {
+    using Clock = std::chrono::steady_clock;
+    auto seconds = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    std::vector<SweepResult> results;
+    if (model_type == ModelType::NONE || isBusy())
+        return results;
+    size_t n_densities = densities.size(), n_coefficients = coefficients.size();
+    size_t n_trees = angles.size() * n_densities;
+    std::vector<SupportTree> trees(n_trees);
+    std::vector<double> tree_seconds(n_trees);
+    long n = n_trees; // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(dynamic, 1) if(n >= omp_get_max_threads())
+    for (long k = 0; k < n; ++k) {
+        auto start = Clock::now();
+        SupportElements elements;
+        std::deque<SupportPoint> points;
+        trees[k] = buildSupportTree(angles[k / n_densities], densities[k % n_densities], false,
+                                    elements, points);
+        tree_seconds[k] = seconds(start);
+    }
+
+    results.resize(n_trees * n_coefficients);
+    n = results.size();
+#pragma omp parallel for schedule(dynamic, 1)
+    for (long i = 0; i < n; ++i) {
+        size_t k = i / n_coefficients;
+        double coefficient = coefficients[i % n_coefficients];
+        auto start = Clock::now();
+        auto estimate = estimateSupport(trees[k], coefficient);
+        results[i] = { angles[k / n_densities], densities[k % n_densities], coefficient,
+                       estimate, tree_seconds[k], seconds(start) };
+    }
+    return results;
+}
+
+QString MyViewer::describeSupport(const SupportEstimate &e) const {
+    return tr("%1 struts, %2 contacts on the model, volume: %3, total length: %4, "
+              "longest strut: %5, tallest column: %6")
+        .arg(e.struts).arg(e.contacts).arg(e.volume).arg(e.total_length)
+        .arg(e.longest_strut).arg(e.tallest_column);
+}
 
+// Thicker for longer and more slanted struts
+double MyViewer::strutRadius(const Vec &top, const Vec &bottom, double coefficient) const {
+    Vec d = top - bottom;
+    double length = d.norm();
+    double angle = length > 0 ? acos(d.z / length) : 0.0;
+    double r = coefficient * length * (angle == 0 ? 1 : angle);
+    //double r = (diameterCoefficient * (topPoint - bottomPoint).norm() * (1 - angleOfVectors(topPoint-bottomPoint, Vec(0,0,1))));
+    return std::max(r, 1.0);
+}
 
-void MyViewer::addStrut(SupportPoint top, SupportPoint bottom){
+void MyViewer::addStrut(MyMesh &target, SupportPoint top, SupportPoint bottom){
     Vec topPoint = top.location;
     Vec bottomPoint = bottom.location;
-    double length = (top.location - bottom.location).norm();
-    double r = (diameterCoefficient * length * (angleOfVectors(top.location - bottom.location, Vec(0,0,1)) == 0 ? 1 : angleOfVectors(top.location - bottom.location, Vec(0,0,1))));
-    //double r = (diameterCoefficient * (topPoint - bottomPoint).norm() * (1 - angleOfVectors(topPoint-bottomPoint, Vec(0,0,1))));
-    if (r < 1) r = 1;
+    double r = strutRadius(topPoint, bottomPoint, diameterCoefficient);
     std::vector<Vec> topTriangle, bottomTriangle;
     for(int i = 0; i < 3; ++i){
         Vec newPoint = rotateAround(Vec(r, 0.0, 0.0), Vec(0.0, 0.0, 1.0), i * 2 * M_PI / 3);
@@ -1303,62 +3059,71 @@ void MyViewer::addStrut(SupportPoint top, SupportPoint bottom){
         addFace(topTriangle[2], bottomTriangle[1], topTriangle[1]);
         addFace(topTriangle[1], bottomTriangle[1], bottomTriangle[2]);
         addFace(topTriangle[1], bottomTriangle[2], topTriangle[0]);*/
-        addFace(top.location, bottomTriangle[0], bottomTriangle[1]);
-        addFace(top.location, bottomTriangle[1], bottomTriangle[2]);
-        addFace(top.location, bottomTriangle[2], bottomTriangle[0]);
+        addFace(target, top.location, bottomTriangle[0], bottomTriangle[1]);
+        addFace(target, top.location, bottomTriangle[1], bottomTriangle[2]);
+        addFace(target, top.location, bottomTriangle[2], bottomTriangle[0]);
     } else {
-        addFace(topTriangle[0], topTriangle[1], topTriangle[2]);
+        addFace(target, topTriangle[0], topTriangle[1], topTriangle[2]);
 
         if (bottom.type == MODEL){
-            addFace(topTriangle[0], bottomTriangle[1], bottomTriangle[2]);
-            addFace(topTriangle[0], bottomTriangle[2], topTriangle[1]);
-            addFace(topTriangle[1], bottomTriangle[2], bottomTriangle[0]);
-            addFace(topTriangle[1], bottomTriangle[0], topTriangle[2]);
-            addFace(topTriangle[2], bottomTriangle[0], bottomTriangle[1]);
-            addFace(topTriangle[2], bottomTriangle[1], topTriangle[0]);
+            addFace(target, topTriangle[0], bottomTriangle[1], bottomTriangle[2]);
+            addFace(target, topTriangle[0], bottomTriangle[2], topTriangle[1]);
+            addFace(target, topTriangle[1], bottomTriangle[2], bottomTriangle[0]);
+            addFace(target, topTriangle[1], bottomTriangle[0], topTriangle[2]);
+            addFace(target, topTriangle[2], bottomTriangle[0], bottomTriangle[1]);
+            addFace(target, topTriangle[2], bottomTriangle[1], topTriangle[0]);
         }
         else {
-            addFace(topTriangle[0], bottomTriangle[0], bottomTriangle[1]);
-            addFace(topTriangle[0], bottomTriangle[1], topTriangle[1]);
-            addFace(topTriangle[1], bottomTriangle[1], bottomTriangle[2]);
-            addFace(topTriangle[1], bottomTriangle[2], topTriangle[2]);
-            addFace(topTriangle[2], bottomTriangle[2], bottomTriangle[0]);
-            addFace(topTriangle[2], bottomTriangle[0], topTriangle[0]);
-            addFace(bottomTriangle[2], bottomTriangle[1], bottomTriangle[0]);
+            addFace(target, topTriangle[0], bottomTriangle[0], bottomTriangle[1]);
+            addFace(target, topTriangle[0], bottomTriangle[1], topTriangle[1]);
+            addFace(target, topTriangle[1], bottomTriangle[1], bottomTriangle[2]);
+            addFace(target, topTriangle[1], bottomTriangle[2], topTriangle[2]);
+            addFace(target, topTriangle[2], bottomTriangle[2], bottomTriangle[0]);
+            addFace(target, topTriangle[2], bottomTriangle[0], topTriangle[0]);
+            addFace(target, bottomTriangle[2], bottomTriangle[1], bottomTriangle[0]);
         }
     }
 }
 
-void MyViewer::addFace(Vec v1, Vec v2, Vec v3){
-    MyMesh::VertexHandle vh1 = supportMesh.add_vertex(MyMesh::Point(v1.v_));
-    MyMesh::VertexHandle vh2 = supportMesh.add_vertex(MyMesh::Point(v2.v_));
-    MyMesh::VertexHandle vh3 = supportMesh.add_vertex(MyMesh::Point(v3.v_));
+std::pair<int,int> MyViewer::addNodeStrut(MyMesh &target, const SupportTree &tree, int i){
+    int first = target.n_faces(), parent = tree.parents[i];
+    if (parent >= 0 && tree.positions[i] != tree.positions[parent])
+        addStrut(target, tree.node(i), tree.node(parent));
+    return { first, (int)target.n_faces() };
+}
+
+void MyViewer::addFace(MyMesh &target, Vec v1, Vec v2, Vec v3){
+    MyMesh::VertexHandle vh1 = target.add_vertex(MyMesh::Point(Vector(v1.v_)));
+    MyMesh::VertexHandle vh2 = target.add_vertex(MyMesh::Point(Vector(v2.v_)));
+    MyMesh::VertexHandle vh3 = target.add_vertex(MyMesh::Point(Vector(v3.v_)));
     std::vector<MyMesh::VertexHandle> faceVertices;
     faceVertices.push_back(vh1);
     faceVertices.push_back(vh2);
     faceVertices.push_back(vh3);
-    supportMesh.add_face(faceVertices);
+    target.add_face(faceVertices);
 }
 
-double MyViewer::degToRad(double deg){
+double MyViewer::degToRad(double deg) const {
     return deg * M_PI / 180;
 }
 
-double MyViewer::angleOfVectors(Vec v1, Vec v2){
+double MyViewer::angleOfVectors(Vec v1, Vec v2) const {
     return acos(v1 * v2 / (v1.norm() * v2.norm()));
 }
 
-Vec MyViewer::vertexToVec(OpenMesh::SmartVertexHandle v){
-    auto vtxdata = mesh.point(v).data();
-    return Vec(vtxdata[0], vtxdata[1], vtxdata[2]);
+Vec MyViewer::vertexToVec(OpenMesh::SmartVertexHandle v) const {
+    return Vec(snapshot->point(v.idx()));
 }
 
 Vec MyViewer::rotateAround(Vec v, Vec pivot, double angle){
     return v * cos(angle) + (pivot ^ v) * sin(angle) + pivot * (pivot * v) * (1 - cos(angle)); // Rodrigues' rotation formula
 }
 
-void MyViewer::sortPointsToSupport(){
-    std::sort(pointsToSupport.begin(), pointsToSupport.end(), [](SupportPoint a, SupportPoint b) {
-        if (a.location.z == b.location.z) return a.location.x+a.location.y > b.location.x+b.location.y;
-        else return a.location.z > b.location.z;});
+// Descending Z; ties are broken by the other coordinates, so the order is the same for any input order
+bool MyViewer::isHigher(const SupportPoint &a, const SupportPoint &b){
+    if (a.location.z != b.location.z) return a.location.z > b.location.z;
+    if (a.location.x+a.location.y != b.location.x+b.location.y) return a.location.x+a.location.y > b.location.x+b.location.y;
+    if (a.location.x != b.location.x) return a.location.x > b.location.x;
+    return a.location.y > b.location.y;
 }
+
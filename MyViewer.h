@@ -1,18 +1,43 @@
 // -*- mode: c++ -*-
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <deque>
+#include <functional>
+#include <memory>
 
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFuture>
 #include <QGLViewer/qglviewer.h>
 #include <OpenMesh/Core/Mesh/TriMesh_ArrayKernelT.hh>
 
+#include "height-field.h"
+#include "implicit-fairing.h"
+#include "mesh-snapshot.h"
+#include "orientation.h"
+
+#ifdef USE_JET_FITTING
+#include "jet-wrapper.h"
+#endif
+
 using qglviewer::Vec;
 
+#ifdef USE_OFFSCREEN
+class OffscreenContext;
+#endif
+
 class MyViewer : public QGLViewer {
     Q_OBJECT
 
 public:
+    // Precision of the stored geometry; computations are still done in double precision
+#ifdef SINGLE_PRECISION_MESH
+    using Scalar = float;
+#else
+    using Scalar = double;
+#endif
+
     explicit MyViewer(QWidget *parent);
     virtual ~MyViewer();
 
@@ -30,11 +55,23 @@ public:
     bool openBezier(const std::string &filename, bool update_view = true);
     bool saveMesh(const std::string &filename);
     bool saveBezier(const std::string &filename);
+    inline size_t getHeightFieldResolution() const;
+    inline void setHeightFieldResolution(size_t resolution);
+    inline bool isBusy() const;
+    inline void setAsynchronous(bool async);
+#ifdef USE_OFFSCREEN
+    bool renderViews(const std::string &prefix, size_t views, int size,
+                     const std::string &mode = "plain");
+#endif
+
+public slots:
+    void cancelComputation();
 
 signals:
     void startComputation(QString message);
     void midComputation(int percent);
     void endComputation();
+    void computationFailed(QString message);
 
 protected:
     virtual void init() override;
@@ -43,14 +80,15 @@ protected:
     virtual void postSelection(const QPoint &p) override;
     virtual void keyPressEvent(QKeyEvent *e) override;
     virtual void mouseMoveEvent(QMouseEvent *e) override;
+    virtual void mouseReleaseEvent(QMouseEvent *e) override;
     virtual QString helpString() const override;
 
 private:
     struct MyTraits : public OpenMesh::DefaultTraits {
-        using Point  = OpenMesh::Vec3d; // the default would be Vec3f
-        using Normal = OpenMesh::Vec3d;
+        using Point  = OpenMesh::VectorT<Scalar,3>; // the default would be Vec3f
+        using Normal = OpenMesh::VectorT<Scalar,3>;
         VertexTraits {
-            double mean;              // approximated mean curvature
+            Scalar mean;              // approximated mean curvature
         };
     };
     using MyMesh = OpenMesh::TriMesh_ArrayKernelT<MyTraits>;
@@ -58,9 +96,14 @@ private:
 
     // Mesh
     void updateMesh(bool update_mean_range = true);
+    void finishMeshUpdate(bool update_mean_range);
+    // Native cache of mesh files, with their normals and curvature, for quick reloading
+    bool loadMeshCache(const std::string &filename);
+    void saveMeshCache(const std::string &filename) const;
+    void updateTopology();
     void updateVertexNormals();
 #ifdef USE_JET_FITTING
-    void updateWithJetFit(size_t neighbors);
+    void updateWithJetFit(size_t neighbors, double radius = 0);
 #endif
     void localSystem(const Vector &normal, Vector &u, Vector &v);
     double voronoiWeight(MyMesh::HalfedgeHandle in_he);
@@ -69,18 +112,35 @@ private:
 
     // Bezier
     static void bernsteinAll(size_t n, double u, std::vector<double> &coeff);
+    static void bernsteinDerivatives(size_t n, size_t order, double u, std::vector<double> &coeff);
+    void updateBezierBasis(size_t resolution);
+    // Also writes Su, Sv, Suu, Suv, Svv into `derivatives`, when given
+    Vector evaluateBezier(double u, double v, Vector *derivatives = nullptr) const;
+    static bool bezierNormalAndMean(const Vector *derivatives, Vector &normal, double &mean);
+    void updateSingularPoints(const std::vector<MyMesh::VertexHandle> &singular);
+    double controlNetSize() const;
     void generateMesh(size_t resolution);
+    void generateAdaptiveMesh(double tolerance);
 
     // Visualization
     void setupCamera();
+    void boundingBox(Vector &box_min, Vector &box_max, bool with_supports) const;
     Vec meanMapColor(double d) const;
     void drawControlNet() const;
     void drawAxes() const;
     void drawAxesWithNames() const;
+    bool setVisualization(const std::string &mode);
     static Vec intersectLines(const Vec &ap, const Vec &ad, const Vec &bp, const Vec &bd);
 
     // Other
     void fairMesh();
+    void fairMeshImplicit();
+    void rotateModel(const Vector &up); // turns `up` to +Z
+
+    // Background computations
+    using Publish = std::function<void()>;
+    void runAsync(const QString &message, std::function<Publish()> job);
+    void reportProgress(int percent);
 
     //////////////////////
     // Member variables //
@@ -90,10 +150,44 @@ private:
 
     // Mesh
     MyMesh mesh;
+#ifdef USE_JET_FITTING
+    // Kept between updates, so that only the jets around moved points are refitted
+    JetWrapper::PointVector jet_points;
+    std::unique_ptr<JetWrapper::Nearest> jet_nearest;
+    std::vector<JetWrapper::JetData> jets;
+#endif
 
     // Bezier
     size_t degree[2];
     std::vector<Vec> control_points;
+    struct BezierBasis {
+        size_t resolution, degree[2];
+        std::vector<double> u, v; // Bernstein values on the grid, resolution x (degree + 1)
+        std::vector<double> du, dv, duu, dvv; // their first and second derivatives
+    } bezier_basis;
+    size_t grid_resolution;       // of the grid tessellation in `mesh` (0: no such grid)
+    bool adaptive_tessellation;   // except while dragging, when the cached uniform grid is used
+    bool dragging;                // a control point, vertex or support contact, with the axes
+    double tessellation_tolerance; // chordal error, relative to the size of the control net
+
+    // Flat copy of the connectivity, rebuilt only when `topology_changed` is set
+    struct Topology {
+        std::vector<int> faces;            // 3 vertex indices per face
+        std::vector<int> offsets, corners; // corners (indices into `faces`) of each vertex
+    } topology;
+    bool topology_changed;
+    std::shared_ptr<const MeshSnapshot<Scalar>> snapshot; // rebuilt by updateMesh, after a drag
+    std::shared_ptr<const HeightField> height_field;       // likewise
+    size_t height_field_resolution;                        // 0: automatic
+
+    // Fairing
+    std::unique_ptr<ImplicitFairing::Solver> fairing; // factorized system, kept until the points are edited
+
+    // Background computations
+    bool asynchronous, busy;
+    std::atomic<bool> cancel_requested;
+    QFuture<Publish> running;     // the last job, waited for by the destructor
+    QElapsedTimer progress_timer;
 
     // Visualization
     double mean_min, mean_max, cutoff_ratio;
@@ -102,7 +196,8 @@ private:
     GLuint isophote_texture, environment_texture, current_isophote_texture, slicing_texture;
     Vector slicing_dir;
     double slicing_scaling;
-    int selected_vertex;
+    int selected_vertex;  // also kept fixed by the implicit fairing (-1: none)
+    int selected_support; // contact of the support tree, moved instead of the vertex (-1: none)
     struct ModificationAxes {
         bool shown;
         float size;
@@ -110,6 +205,9 @@ private:
         Vec position, grabbed_pos, original_pos;
     } axes;
     std::string last_filename;
+#ifdef USE_OFFSCREEN
+    std::unique_ptr<OffscreenContext> offscreen; // of renderViews, created once
+#endif
 
     // Clever Support
     enum locationType {
@@ -130,15 +228,49 @@ private:
         }
     };
 
-    struct TreePoint {
+    // Support tree as a graph: every node is stored once, and a strut goes from each node
+    // down to its parent; the roots (on the model or on the plate) have no parent (-1).
+    // The children are listed in contiguous arrays by link().
+    struct SupportTree {
+        std::vector<Vec> positions, normals;
+        std::vector<locationType> types;
+        std::vector<int> parents;
+        std::vector<int> child_offsets, children; // children of i: [child_offsets[i], child_offsets[i+1])
 
-        SupportPoint point;
-        SupportPoint nextPoint;
+        size_t size() const { return positions.size(); }
+        bool empty() const { return positions.empty(); }
+        void clear();
+        void reserve(size_t n);
+        int add(const SupportPoint &p, int parent = -1);
+        SupportPoint node(int i) const { return SupportPoint(positions[i], types[i], normals[i]); }
+        void link();
+        std::vector<int> rootsFirst() const; // every node after its parent
+        // Drops the marked nodes (none of the others may hang from them), and links the rest;
+        // returns the new index of every old node (-1: removed)
+        std::vector<int> remove(const std::vector<char> &removed);
+        void move(int i, const Vec &p);
+        // The highest COMMON node other than `except` strictly below `apex`, inside its downward cone
+        // (with tan(half-angle) t), or -1. The nodes are searched in an XY grid, built by the first
+        // query and then kept in step by add(), move() and remove()
+        int highestInCone(const Vec &apex, double t, int except);
 
-        TreePoint(SupportPoint point, SupportPoint nextPoint): point(point), nextPoint(nextPoint){}
+        // Uniform grid of the COMMON nodes, with about one in a cell; all of them are inside it
+        struct Grid {
+            double minX = 0, minY = 0, maxX = 0, maxY = 0, cell = 1;
+            int nx = 0, ny = 0;
+            double lowest = 0;                   // no node is below this
+            std::vector<std::vector<int>> cells; // empty when not built
+            int cellX(double x) const { return std::min(std::max((int)((x - minX) / cell), 0), nx - 1); }
+            int cellY(double y) const { return std::min(std::max((int)((y - minY) / cell), 0), ny - 1); }
+        } grid;
+        void buildGrid();
+        void insertIntoGrid(int i); // drops the grid when i is outside
     };
 
     MyMesh supportMesh;
+    // Faces of the strut from each node of supportTree down to its parent in supportMesh;
+    // kept in step with the tree only while supportMesh is its geometry (otherwise empty)
+    std::vector<std::pair<int,int>> strutFaces;
     double gridDensity;
     double angleLimit;
     double diameterCoefficient;
@@ -149,8 +281,25 @@ private:
     std::vector<OpenMesh::SmartVertexHandle> verticesToSupport;
     std::vector<OpenMesh::SmartFaceHandle> facesToSupport;
     std::vector<OpenMesh::SmartEdgeHandle> edgesToSupport;
+    // Connected region of the elements above, with its area (of the faces) and lowest point
+    struct OverhangIsland {
+        std::vector<OpenMesh::SmartFaceHandle> faces;
+        std::vector<OpenMesh::SmartEdgeHandle> edges;
+        std::vector<OpenMesh::SmartVertexHandle> vertices;
+        double area;
+        Vec lowest;
+    };
+    std::vector<OverhangIsland> overhangIslands;
+    // The elements above for a given angle limit, as a tree build works on them
+    struct SupportElements {
+        std::vector<OpenMesh::SmartVertexHandle> vertices;
+        std::vector<OpenMesh::SmartFaceHandle> faces;
+        std::vector<OpenMesh::SmartEdgeHandle> edges;
+        std::vector<OverhangIsland> islands;
+    };
+    std::vector<Orientation::Candidate> orientations; // best first
     std::deque<SupportPoint> pointsToSupport;
-    std::vector<TreePoint> treePoints;
+    SupportTree supportTree;
 
 public:
     inline double getGridDensity() const;
@@ -162,27 +311,76 @@ public:
     inline void toggleCones();
     inline void toggleTree();
     void colorFacesEdgesAndPoints();
-    void getElementsThatNeedSupport();
+    void getElementsThatNeedSupport(); // into the members above, for angleLimit
+    SupportElements findElementsThatNeedSupport(double angle) const;
     void showAllPointsToSupport();
-    void calculatePointsToSupport();
-    void generateEdgePoints(Vec A, Vec B, int density, Vec normal);
-    void generateFacePoints(OpenMesh::SmartFaceHandle f);
+    void calculatePointsToSupport();   // likewise, for gridDensity
+    std::deque<SupportPoint> findPointsToSupport(const std::vector<OverhangIsland> &islands,
+                                                 double density) const; // highest first
+    void generateEdgePoints(std::deque<SupportPoint> &points, Vec A, Vec B, int density, Vec normal) const;
+    void generateFacePoints(std::deque<SupportPoint> &points, OpenMesh::SmartFaceHandle f, double density) const;
     void generateCones();
     void drawTree();
     void calculateSupportTreePoints();
-    SupportPoint getClosestPointFromPoints(SupportPoint p);
-    Vec getCommonSupportPoint(Vec p1, Vec p2);
-    SupportPoint getClosestPointOnModel(SupportPoint p);
-    Vec projectToTriangle(const Vec &p, const OpenMesh::SmartFaceHandle &f);
+    void optimizeOrientation(bool apply = true);
+    // Cost of the supports in `supportTree`, without building their geometry
+    struct SupportEstimate {
+        size_t struts, contacts;  // contacts: strut ends on the model
+        double volume;            // of the struts, as addStrut would build them
+        double total_length, longest_strut;
+        double tallest_column;    // largest drop from a strut top to where its branch ends
+    };
+    SupportEstimate estimateSupport() const;
+    SupportEstimate estimateSupport(double coefficient) const; // with another diameter coefficient
+    SupportEstimate estimateSupport(const SupportTree &tree, double coefficient) const;
+    QString describeSupport(const SupportEstimate &estimate) const;
+    // Estimates for every combination of the parameters on the current model
+    struct SweepResult {
+        double angle, density, coefficient;
+        SupportEstimate estimate;
+        double tree_seconds;     // building the tree, shared by the coefficients
+        double estimate_seconds;
+    };
+    std::vector<SweepResult> sweepSupport(const std::vector<double> &angles,
+                                          const std::vector<double> &densities,
+                                          const std::vector<double> &coefficients);
+    // For angleLimit and gridDensity, also returning the elements and points of the tree
+    // (published by setSupportElements)
+    SupportTree computeSupportTree(SupportElements &elements, std::deque<SupportPoint> &points);
+    void setSupportElements(SupportElements &elements, std::deque<SupportPoint> &points); // swapped in
+    // Without the cache, for the given parameters; the viewer is only read,
+    // so several trees can be built at once (without progress reports)
+    SupportTree buildSupportTree(double angle, double density, bool progress,
+                                 SupportElements &elements, std::deque<SupportPoint> &points);
+    // Computed trees are cached on disk, keyed by the geometry and the support parameters
+    QString supportTreeCacheFile() const;
+    static bool loadSupportTree(const QString &filename, SupportTree &tree);
+    static void saveSupportTree(const QString &filename, const SupportTree &tree);
+    // Local edits of the tree: only the branch of the edited contact (a node on the model at the top
+    // of a branch) is changed, with its struts in supportMesh. Edited trees are not cached.
+    bool isSupportContact(int i) const;
+    int addSupportPoint(const Vec &location);               // returns the new contact, or -1
+    int moveSupportPoint(int contact, const Vec &location); // likewise; the index may change
+    void dragSupportPoint(int contact, const Vec &location); // only the contact and its short strut
+    void removeSupportPoint(int contact);
+    SupportPoint snapToModel(const Vec &location) const;
+    void routeBranch(int node);
+    void addEditedStruts(size_t first); // of the nodes from `first` on
+    void compactStruts();               // drops the struts deleted by the edits
+    void setStrutNormals(const std::pair<int,int> &faces);
+    Vec getCommonSupportPoint(Vec p1, Vec p2, double angle) const;
+    SupportPoint getClosestPointOnModel(SupportPoint p, double angle) const;
     void addTreeGeometry();
-    void addStrut(SupportPoint top, SupportPoint bottom);
+    double strutRadius(const Vec &top, const Vec &bottom, double coefficient) const;
+    void addStrut(MyMesh &target, SupportPoint top, SupportPoint bottom);
+    std::pair<int,int> addNodeStrut(MyMesh &target, const SupportTree &tree, int i); // its face range
     void addTopConnection(Vec a, Vec b);
-    void addFace(Vec v1, Vec v2, Vec v3);
-    double degToRad(double deg);
-    double angleOfVectors(Vec v1, Vec v2);
-    Vec vertexToVec(OpenMesh::SmartVertexHandle v);
+    void addFace(MyMesh &target, Vec v1, Vec v2, Vec v3);
+    double degToRad(double deg) const;
+    double angleOfVectors(Vec v1, Vec v2) const;
+    Vec vertexToVec(OpenMesh::SmartVertexHandle v) const;
     Vec rotateAround(Vec v, Vec pivot, double angle /*radians*/);
-    void sortPointsToSupport();
+    static bool isHigher(const SupportPoint &a, const SupportPoint &b);
 };
 
 #include "MyViewer.hpp"
@@ -1,6 +1,14 @@
 #pragma once
 #include "MyViewer.h"
 
+bool MyViewer::isBusy() const {
+    return busy;
+}
+
+void MyViewer::setAsynchronous(bool async) {
+    asynchronous = async;
+}
+
 double MyViewer::getCutoffRatio() const {
     return cutoff_ratio;
 }
@@ -26,6 +34,16 @@ void MyViewer::setMeanMax(double max) {
     mean_max = max;
 }
 
+size_t MyViewer::getHeightFieldResolution() const {
+    return height_field_resolution;
+}
+
+void MyViewer::setHeightFieldResolution(size_t resolution) {
+    height_field_resolution = resolution;
+    if (snapshot && !busy) // otherwise at the next update
+        height_field = std::make_shared<const HeightField>(*snapshot, height_field_resolution);
+}
+
 double MyViewer::getGridDensity() const {
     return gridDensity;
 }
@@ -56,6 +74,12 @@ void MyViewer::toggleCones() {
 
 void MyViewer::toggleTree() {
     showTree = !showTree;
+    if (!showTree) {
+        selected_support = -1;
+        axes.shown = false;
+    }
+    if (showTree && supportTree.empty())
+        calculateSupportTreePoints();
 }
 
 const double *MyViewer::getSlicingDir() const {
@@ -13,11 +13,16 @@ MyWindow::MyWindow(QApplication *parent) :
     progress->setMinimum(0); progress->setMaximum(100);
     progress->hide();
     statusBar()->addPermanentWidget(progress);
+    cancel = new QPushButton(tr("Cancel"));
+    cancel->hide();
+    statusBar()->addPermanentWidget(cancel);
 
     viewer = new MyViewer(this);
     connect(viewer, SIGNAL(startComputation(QString)), this, SLOT(startComputation(QString)));
     connect(viewer, SIGNAL(midComputation(int)), this, SLOT(midComputation(int)));
     connect(viewer, SIGNAL(endComputation()), this, SLOT(endComputation()));
+    connect(viewer, SIGNAL(computationFailed(QString)), this, SLOT(computationFailed(QString)));
+    connect(cancel, SIGNAL(clicked()), viewer, SLOT(cancelComputation()));
     setCentralWidget(viewer);
 
     /////////////////////////
@@ -76,6 +81,14 @@ MyWindow::MyWindow(QApplication *parent) :
     auto addTreeGeometryAction = new QAction(tr("Add support tree geometry"), this);
     connect(addTreeGeometryAction, SIGNAL(triggered()), this, SLOT(addTreeGeometry()));
 
+    auto orientationAction = new QAction(tr("&Optimize orientation"), this);
+    orientationAction->setStatusTip(tr("Turn the model to need the least support"));
+    connect(orientationAction, SIGNAL(triggered()), this, SLOT(optimizeOrientation()));
+
+    auto estimateAction = new QAction(tr("&Estimate support cost"), this);
+    estimateAction->setStatusTip(tr("Volume, contacts and strut lengths of the support tree"));
+    connect(estimateAction, SIGNAL(triggered()), this, SLOT(estimateSupport()));
+
     auto setFavoriteAction = new QAction(tr("Set favorite model"), this);
     connect(setFavoriteAction, SIGNAL(triggered()), this, SLOT(setFavoriteModel()));
 
@@ -98,6 +111,8 @@ MyWindow::MyWindow(QApplication *parent) :
     supportMenu->addAction(calculateTreeAction);
     supportMenu->addAction(treePointsAction);
     supportMenu->addAction(addTreeGeometryAction);
+    supportMenu->addAction(orientationAction);
+    supportMenu->addAction(estimateAction);
     supportMenu->addAction(setFavoriteAction);
 
 }
@@ -106,6 +121,8 @@ MyWindow::~MyWindow() {
 }
 
 void MyWindow::open() {
+    if (viewer->isBusy())
+        return;
     auto filename =
         QFileDialog::getOpenFileName(this, tr("Open File"), last_directory,
                                      tr("Readable files (*.obj *.ply *.stl *.bzr);;"
@@ -128,6 +145,8 @@ void MyWindow::open() {
 }
 
 void MyWindow::save() {
+    if (viewer->isBusy())
+        return;
     auto filename =
         QFileDialog::getSaveFileName(this, tr("Save File"), last_directory,
                                      tr("Bézier surface (*.bzr);;STL file (*.stl)"));
@@ -141,6 +160,8 @@ void MyWindow::save() {
 }
 
 void MyWindow::loadfav() {
+    if (viewer->isBusy())
+        return;
     bool ok = viewer->openMesh(favPath.toUtf8().data());
 
     if (!ok)
@@ -409,19 +430,43 @@ void MyWindow::addTreeGeometry(){
     viewer->update();
 }
 
+void MyWindow::optimizeOrientation() {
+    viewer->optimizeOrientation();
+    viewer->update();
+}
+
+void MyWindow::estimateSupport() {
+    if (viewer->isBusy())
+        return;
+    auto estimate = viewer->estimateSupport();
+    if (estimate.struts == 0)
+        QMessageBox::information(this, tr("Support cost"), tr("There is no support tree yet."));
+    else
+        QMessageBox::information(this, tr("Support cost"), viewer->describeSupport(estimate));
+}
+
+// Computations run in the background, and the menus are disabled meanwhile,
+// since most actions would change the data they work on
+
 void MyWindow::startComputation(QString message) {
     statusBar()->showMessage(message);
     progress->setValue(0);
     progress->show();
-    parent->processEvents(QEventLoop::ExcludeUserInputEvents);
+    cancel->show();
+    menuBar()->setEnabled(false);
 }
 
 void MyWindow::midComputation(int percent) {
     progress->setValue(percent);
-    parent->processEvents(QEventLoop::ExcludeUserInputEvents);
 }
 
 void MyWindow::endComputation() {
     progress->hide();
+    cancel->hide();
+    menuBar()->setEnabled(true);
     statusBar()->clearMessage();
 }
+
+void MyWindow::computationFailed(QString message) {
+    QMessageBox::warning(this, tr("Error"), message);
+}
@@ -7,6 +7,7 @@
 
 class QApplication;
 class QProgressBar;
+class QPushButton;
 
 class MyWindow : public QMainWindow {
     Q_OBJECT
@@ -30,14 +31,18 @@ private slots:
     void calculateTreePoints();
     void toggleTree();
     void addTreeGeometry();
+    void optimizeOrientation();
+    void estimateSupport();
     void startComputation(QString message);
     void midComputation(int percent);
     void endComputation();
+    void computationFailed(QString message);
 
 private:
     QApplication *parent;
     MyViewer *viewer;
     QProgressBar *progress;
+    QPushButton *cancel;
     QString last_directory;
     QString favPath = "C:\\clever-support\\build\\basic_shapes.stl";
 };
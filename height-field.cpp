@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "height-field.h"
+
+template <typename Scalar>
+HeightField::HeightField(const MeshSnapshot<Scalar> &mesh, size_t resolution)
+  : min_x(0.0), min_y(0.0), size(1.0), z_min(0.0), nx(1), ny(1), bnx(1), bny(1)
+{
+  using Vector3D = typename MeshSnapshot<Scalar>::Vector3D;
+  size_t n_faces = mesh.n_faces();
+  if (mesh.n_points() > 0) {
+    Vector3D box_min = mesh.point(0), box_max = box_min;
+    for (size_t i = 1; i < mesh.n_points(); ++i) {
+      box_min.minimize(mesh.point(i));
+      box_max.maximize(mesh.point(i));
+    }
+    if (resolution == 0)
+      resolution = std::min(std::max((size_t)std::sqrt((double)n_faces), (size_t)1), (size_t)4096);
+    double longer = std::max(box_max[0] - box_min[0], box_max[1] - box_min[1]);
+    min_x = box_min[0];
+    min_y = box_min[1];
+    z_min = box_min[2];
+    size = longer > 0 ? longer / resolution : 1.0;
+    nx = std::min((size_t)((box_max[0] - box_min[0]) / size) + 1, resolution);
+    ny = std::min((size_t)((box_max[1] - box_min[1]) / size) + 1, resolution);
+  }
+  double eps = size * 1.0e-6; // cells are enlarged by this, so that faces on their sides are kept
+
+  // Calls add(cell, bottom, top) for the cells crossed by face f
+  auto visit = [&](size_t f, auto add) {
+    Vector3D p[3];
+    for (size_t k = 0; k < 3; ++k)
+      p[k] = mesh.point(mesh.vertex(f, k));
+    Vector3D lo = p[0], hi = p[0];
+    lo.minimize(p[1]); lo.minimize(p[2]);
+    hi.maximize(p[1]); hi.maximize(p[2]);
+    size_t i0, j0, i1, j1;
+    cell(lo[0] - eps, lo[1] - eps, i0, j0);
+    cell(hi[0] + eps, hi[1] + eps, i1, j1);
+    Vector3D n = (p[1] - p[0]) % (p[2] - p[0]);
+    // Edge lines in XY, with the triangle on their positive side (unless it is vertical)
+    double area = n[2];
+    bool flat = std::abs(area) > 1.0e-12 * n.norm();
+    for (size_t j = j0; j <= j1; ++j)
+      for (size_t i = i0; i <= i1; ++i) {
+        double x0 = std::max(min_x + i * size - eps, lo[0]), x1 = std::min(min_x + (i + 1) * size + eps, hi[0]);
+        double y0 = std::max(min_y + j * size - eps, lo[1]), y1 = std::min(min_y + (j + 1) * size + eps, hi[1]);
+        double xs[] = { x0, x1, x1, x0 }, ys[] = { y0, y0, y1, y1 };
+        bool outside = false;
+        for (size_t k = 0; flat && !outside && k < 3; ++k) {
+          const Vector3D &a = p[k], &b = p[(k+1)%3];
+          outside = true;
+          for (size_t c = 0; outside && c < 4; ++c)
+            outside = ((b[0] - a[0]) * (ys[c] - a[1]) - (b[1] - a[1]) * (xs[c] - a[0])) * area < 0;
+        }
+        if (outside)
+          continue;
+        double bottom = lo[2], top = hi[2];
+        if (flat) {
+          // The plane over the (clipped) cell
+          double zb = std::numeric_limits<double>::max(), zt = -zb;
+          for (size_t c = 0; c < 4; ++c) {
+            double z = p[0][2] - (n[0] * (xs[c] - p[0][0]) + n[1] * (ys[c] - p[0][1])) / n[2];
+            zb = std::min(zb, z);
+            zt = std::max(zt, z);
+          }
+          bottom = std::max(bottom, zb - eps);
+          top = std::min(top, zt + eps);
+          if (bottom > top) // only by rounding
+            bottom = top = std::min(std::max((zb + zt) / 2, lo[2]), hi[2]);
+        }
+        add(j * nx + i, bottom, top);
+      }
+  };
+
+  // Counted first, then filled
+  size_t n_cells = nx * ny;
+  offsets.assign(n_cells + 1, 0);
+  for (size_t f = 0; f < n_faces; ++f)
+    visit(f, [&](size_t c, double, double) { ++offsets[c+1]; });
+  for (size_t c = 0; c < n_cells; ++c)
+    offsets[c+1] += offsets[c];
+  entries.resize(offsets[n_cells]);
+  {
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t f = 0; f < n_faces; ++f)
+      visit(f, [&](size_t c, double bottom, double top) { entries[next[c]++] = { (int)f, bottom, top }; });
+  }
+
+  intervals.resize(entries.size());
+  interval_counts.assign(n_cells, 0);
+  long n = n_cells; // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(dynamic, 64)
+  for (long c = 0; c < n; ++c) {
+    auto first = entries.begin() + offsets[c], last = entries.begin() + offsets[c+1];
+    std::sort(first, last, [](const Entry &a, const Entry &b) { return a.bottom < b.bottom; });
+    size_t count = 0;
+    for (auto it = first; it != last; ++it) {
+      Interval *previous = count ? &intervals[offsets[c] + count - 1] : nullptr;
+      if (previous && it->bottom <= previous->top)
+        previous->top = std::max(previous->top, it->top);
+      else
+        intervals[offsets[c] + count++] = { it->bottom, it->top };
+    }
+    interval_counts[c] = count;
+  }
+
+  bnx = (nx + block_size - 1) / block_size;
+  bny = (ny + block_size - 1) / block_size;
+  double inf = std::numeric_limits<double>::infinity();
+  block_ranges.assign(bnx * bny, { inf, -inf });
+  for (size_t j = 0; j < ny; ++j)
+    for (size_t i = 0; i < nx; ++i)
+      if (interval_counts[j*nx+i] > 0) {
+        Interval &range = block_ranges[(j/block_size)*bnx+i/block_size];
+        range.bottom = std::min(range.bottom, intervalsBegin(i, j)->bottom);
+        range.top = std::max(range.top, (intervalsEnd(i, j) - 1)->top);
+      }
+}
+
+void HeightField::cell(double x, double y, size_t &i, size_t &j) const {
+  double u = std::floor((x - min_x) / size), v = std::floor((y - min_y) / size);
+  i = (size_t)std::min(std::max(u, 0.0), (double)(nx - 1));
+  j = (size_t)std::min(std::max(v, 0.0), (double)(ny - 1));
+}
+
+double HeightField::distance(double x, double y, size_t i, size_t j) const {
+  double x0 = min_x + i * size, y0 = min_y + j * size;
+  double dx = std::max(std::max(x0 - x, x - x0 - size), 0.0);
+  double dy = std::max(std::max(y0 - y, y - y0 - size), 0.0);
+  return std::sqrt(dx * dx + dy * dy);
+}
+
+double HeightField::below(double x, double y, double z) const {
+  size_t i, j;
+  cell(x, y, i, j);
+  if (distance(x, y, i, j) > size * 1.0e-6)
+    return -std::numeric_limits<double>::infinity(); // outside the mesh
+  for (const Interval *it = intervalsEnd(i, j); it != intervalsBegin(i, j); ) {
+    --it;
+    if (it->bottom < z)
+      return std::min(it->top, z);
+  }
+  return -std::numeric_limits<double>::infinity();
+}
+
+template HeightField::HeightField(const MeshSnapshot<float> &, size_t);
+template HeightField::HeightField(const MeshSnapshot<double> &, size_t);
@@ -0,0 +1,109 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "mesh-snapshot.h"
+
+// Multi-layer height field of a mesh, for questions about what lies below a point.
+// The XY bounding box is divided into a uniform grid of square cells; every cell stores
+// the faces crossing it, with their Z range inside the cell, and the union of these ranges
+// as disjoint intervals. The ranges are conservative: they contain the part of the face
+// above the cell, so a query can look at a few cells first, and test exactly only
+// the faces listed there.
+class HeightField {
+public:
+  struct Interval {
+    double bottom, top;
+  };
+  struct Entry {
+    int face;
+    double bottom, top;   // of the face, above the cell
+  };
+
+  // `resolution` is the number of cells along the longer side of the box (0: about one face per cell)
+  template <typename Scalar>
+  HeightField(const MeshSnapshot<Scalar> &mesh, size_t resolution = 0);
+
+  size_t columns() const { return nx; }
+  size_t rows() const { return ny; }
+  double cellSize() const { return size; }
+  double lowest() const { return z_min; }
+
+  // The cell containing (x, y); points outside the grid are moved to the nearest cell
+  void cell(double x, double y, size_t &i, size_t &j) const;
+  // XY distance of (x, y) from cell (i, j)
+  double distance(double x, double y, size_t i, size_t j) const;
+
+  // Faces of cell (i, j), by increasing bottom
+  const Entry *entriesBegin(size_t i, size_t j) const { return entries.data() + offsets[j*nx+i]; }
+  const Entry *entriesEnd(size_t i, size_t j) const { return entries.data() + offsets[j*nx+i+1]; }
+  // Occupied intervals of cell (i, j), disjoint and in increasing order
+  const Interval *intervalsBegin(size_t i, size_t j) const { return intervals.data() + offsets[j*nx+i]; }
+  const Interval *intervalsEnd(size_t i, size_t j) const {
+    return intervals.data() + offsets[j*nx+i] + interval_counts[j*nx+i];
+  }
+
+  // Whether anything above cell (i, j) may reach below z
+  bool reaches(size_t i, size_t j, double z) const {
+    return interval_counts[j*nx+i] > 0 && intervals[offsets[j*nx+i]].bottom < z;
+  }
+  // An upper bound for the height of the surface strictly below (x, y, z);
+  // -infinity when there is certainly nothing there
+  double below(double x, double y, double z) const;
+
+  // Visits the cells around (x, y) in square rings of blocks (of block_size x block_size cells),
+  // nearest first. `ring(d)` is called before each ring, with a lower bound d for the XY distance
+  // of its cells (and those of all later rings), and the search stops when it returns false.
+  // `block(bottom, top, d)` tells whether to visit a block at XY distance d, whose faces lie
+  // between `bottom` and `top` (infinity and -infinity if it has none); `cell(i, j)` is called
+  // for the cells of the visited blocks.
+  template <typename Ring, typename Block, typename Cell>
+  void around(double x, double y, Ring ring, Block block, Cell cell) const;
+
+private:
+  static const size_t block_size = 16;
+
+  double min_x, min_y, size, z_min;
+  size_t nx, ny;
+  size_t bnx, bny;                     // number of blocks
+  std::vector<Interval> block_ranges;
+  std::vector<size_t> offsets;         // of the cells in `entries` and `intervals`
+  std::vector<Entry> entries;
+  std::vector<Interval> intervals;     // only the first interval_counts[c] are used in cell c
+  std::vector<size_t> interval_counts;
+};
+
+template <typename Ring, typename Block, typename Cell>
+void HeightField::around(double x, double y, Ring ring, Block block, Cell cell) const {
+  size_t ci, cj;
+  this->cell(x, y, ci, cj);
+  ci /= block_size;
+  cj /= block_size;
+  double block_width = size * block_size;
+  for (size_t k = 0, rings = std::max(bnx, bny); k < rings; ++k) {
+    if (!ring(k > 0 ? (k - 1) * block_width : 0.0))
+      break;
+    size_t i0 = ci >= k ? ci - k : 0, i1 = std::min(ci + k, bnx - 1);
+    size_t j0 = cj >= k ? cj - k : 0, j1 = std::min(cj + k, bny - 1);
+    for (size_t bj = j0; bj <= j1; ++bj) {
+      // Only the first and last rows of the ring are full
+      size_t step = bj + k == cj || bj == cj + k ? 1 : std::max(i1 - i0, (size_t)1);
+      for (size_t bi = i0; bi <= i1; bi += step) {
+        if (std::max(ci > bi ? ci - bi : bi - ci, cj > bj ? cj - bj : bj - cj) != k)
+          continue; // clamped to the grid, not on this ring
+        double bx = min_x + bi * block_width, by = min_y + bj * block_width;
+        double dx = std::max(std::max(bx - x, x - bx - block_width), 0.0);
+        double dy = std::max(std::max(by - y, y - by - block_width), 0.0);
+        const Interval &range = block_ranges[bj*bnx+bi];
+        if (!block(range.bottom, range.top, std::sqrt(dx * dx + dy * dy)))
+          continue;
+        for (size_t j = bj * block_size, je = std::min(j + block_size, ny); j < je; ++j)
+          for (size_t i = bi * block_size, ie = std::min(i + block_size, nx); i < ie; ++i)
+            cell(i, j);
+      }
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+
+#include "Eigen/SparseCholesky"
+#include "Eigen/SparseCore"
+
+#include "implicit-fairing.h"
+
+namespace ImplicitFairing {
+
+using SparseMatrix = Eigen::SparseMatrix<double>;
+using Triplet = Eigen::Triplet<double>;
+
+struct System {
+  std::vector<bool> fixed;   // including the points without any area
+  std::vector<size_t> index; // among the free or among the fixed points
+  std::vector<double> mass;  // of the free points
+  SparseMatrix boundary;     // t L, restricted to free rows and fixed columns
+  Eigen::SimplicialLDLT<SparseMatrix> ldlt;
+};
+
+// Cotangent of the angle between a and b
+static double cotangent(const Vector3D &a, const Vector3D &b) {
+  double sine = (a % b).norm();
+  return (a | b) / std::max(sine, 1.0e-10 * a.norm() * b.norm());
+}
+
+Solver::Solver(const PointVector &points, const std::vector<size_t> &triangles,
+               const std::vector<bool> &fixed, double time)
+  : n_points(points.size()), fixed(fixed), system(nullptr)
+{
+  auto s = new System;
+  system = reinterpret_cast<void *>(s);
+
+  // Lumped mass: a third of the area of the adjacent triangles
+  std::vector<double> area(n_points, 0.0);
+  for (size_t f = 0; f + 2 < triangles.size(); f += 3) {
+    const auto &p0 = points[triangles[f]], &p1 = points[triangles[f+1]], &p2 = points[triangles[f+2]];
+    double a = ((p1 - p0) % (p2 - p0)).norm() / 6.0;
+    for (size_t k = 0; k < 3; ++k)
+      area[triangles[f+k]] += a;
+  }
+
+  size_t n_free = 0, n_fixed = 0;
+  s->fixed.resize(n_points);
+  s->index.resize(n_points);
+  for (size_t i = 0; i < n_points; ++i) {
+    s->fixed[i] = fixed[i] || area[i] == 0.0;
+    if (s->fixed[i])
+      s->index[i] = n_fixed++;
+    else {
+      s->index[i] = n_free++;
+      s->mass.push_back(area[i]);
+    }
+  }
+
+  // M + t L on the free points, and t L from the fixed ones
+  std::vector<Triplet> a_triplets, b_triplets;
+  auto add = [&](size_t row, size_t col, double value) {
+    if (s->fixed[row])
+      return;
+    if (s->fixed[col])
+      b_triplets.emplace_back(s->index[row], s->index[col], time * value);
+    else
+      a_triplets.emplace_back(s->index[row], s->index[col], time * value);
+  };
+  for (size_t i = 0; i < n_points; ++i)
+    if (!s->fixed[i])
+      a_triplets.emplace_back(s->index[i], s->index[i], area[i]);
+  for (size_t f = 0; f + 2 < triangles.size(); f += 3)
+    for (size_t k = 0; k < 3; ++k) {
+      // The angle at corner k weights the opposite edge (i, j)
+      size_t c = triangles[f+k], i = triangles[f+(k+1)%3], j = triangles[f+(k+2)%3];
+      double w = cotangent(points[i] - points[c], points[j] - points[c]) / 2.0;
+      add(i, j, -w); add(j, i, -w);
+      add(i, i, w);  add(j, j, w);
+    }
+
+  SparseMatrix A(n_free, n_free);
+  A.setFromTriplets(a_triplets.begin(), a_triplets.end());
+  s->boundary.resize(n_free, n_fixed);
+  s->boundary.setFromTriplets(b_triplets.begin(), b_triplets.end());
+  s->ldlt.compute(A);
+}
+
+Solver::~Solver() {
+  delete reinterpret_cast<System *>(system);
+}
+
+bool Solver::isValid() const {
+  return reinterpret_cast<const System *>(system)->ldlt.info() == Eigen::Success;
+}
+
+bool Solver::compatible(size_t n_points, const std::vector<bool> &fixed) const {
+  return this->n_points == n_points && this->fixed == fixed;
+}
+
+void Solver::operator()(PointVector &points) const {
+  const System &s = *reinterpret_cast<const System *>(system);
+  size_t n_free = s.mass.size(), n_fixed = n_points - n_free;
+  Eigen::VectorXd rhs(n_free), boundary(n_fixed);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t i = 0; i < n_points; ++i)
+      if (s.fixed[i])
+        boundary(s.index[i]) = points[i][c];
+      else
+        rhs(s.index[i]) = s.mass[s.index[i]] * points[i][c];
+    rhs -= s.boundary * boundary;
+    Eigen::VectorXd x = s.ldlt.solve(rhs);
+    for (size_t i = 0; i < n_points; ++i)
+      if (!s.fixed[i])
+        points[i][c] = x(s.index[i]);
+  }
+}
+
+}
@@ -0,0 +1,39 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <vector>
+
+#include <OpenMesh/Core/Geometry/VectorT.hh>
+
+namespace ImplicitFairing {
+
+using Vector3D = OpenMesh::VectorT<double,3>;
+using PointVector = std::vector<Vector3D>;
+
+// Implicit integration of the diffusion flow, as in:
+//   M. Desbrun, M. Meyer, P. Schroeder, A. Barr, Implicit fairing of irregular meshes
+//     using diffusion and curvature flow. SIGGRAPH, 1999.
+//
+// One step solves (M + t L) x = M x0, where L is the cotangent Laplacian
+// and M the lumped mass matrix, both taken from the points given at construction.
+// The system is factorized only once, so repeated steps are cheap.
+// Fixed points are kept in place, and enter the system as boundary conditions.
+class Solver {
+public:
+  // `triangles` holds three vertex indices per face
+  Solver(const PointVector &points, const std::vector<size_t> &triangles,
+         const std::vector<bool> &fixed, double time);
+  ~Solver();
+  bool isValid() const;
+  // Whether the factorization can be reused for a mesh with these parameters
+  bool compatible(size_t n_points, const std::vector<bool> &fixed) const;
+  // One step, in place
+  void operator()(PointVector &points) const;
+
+private:
+  size_t n_points;
+  std::vector<bool> fixed;
+  void *system; // to avoid the Eigen sparse includes
+};
+
+}
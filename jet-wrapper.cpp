@@ -1,13 +1,18 @@
 #ifdef USE_JET_FITTING
 
-#include <boost/iterator/function_output_iterator.hpp>
+#include <algorithm>
+#include <limits>
+
+#include <boost/iterator/counting_iterator.hpp>
 
 #include <CGAL/Eigen_svd.h>
 #include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
-#include <CGAL/Fuzzy_sphere.h>
 #include <CGAL/Monge_via_jet_fitting.h>
+#include <CGAL/Orthogonal_incremental_neighbor_search.h>
 #include <CGAL/Orthogonal_k_neighbor_search.h>
+#include <CGAL/property_map.h>
 #include <CGAL/Search_traits_3.h>
+#include <CGAL/Search_traits_adapter.h>
 
 #include "jet-wrapper.h"
 
@@ -16,13 +21,14 @@ namespace JetWrapper {
 using Kernel = CGAL::Exact_predicates_inexact_constructions_kernel;
 using Point_3 = Kernel::Point_3;
 using Vector_3 = Kernel::Vector_3;
-using Tree_traits = CGAL::Search_traits_3<Kernel>;
+using Base_traits = CGAL::Search_traits_3<Kernel>;
+using Point_map = CGAL::Pointer_property_map<Point_3>::type;
+using Tree_traits = CGAL::Search_traits_adapter<size_t, Point_map, Base_traits>; // stores indices
 using Splitter = CGAL::Sliding_midpoint<Tree_traits>;
 using Tree = CGAL::Kd_tree<Tree_traits, Splitter, CGAL::Tag_true>;
-using Distance = CGAL::Euclidean_distance<Tree_traits>;
+using Distance = CGAL::Distance_adapter<size_t, Point_map, CGAL::Euclidean_distance<Base_traits>>;
 using Neighbor_search = CGAL::Orthogonal_k_neighbor_search<Tree_traits, Distance, Splitter, Tree>;
-using Search_iterator = Neighbor_search::iterator;
-using Sphere = CGAL::Fuzzy_sphere<Tree_traits>;
+using Incremental_search = CGAL::Orthogonal_incremental_neighbor_search<Tree_traits, Distance, Splitter, Tree>;
 
 // Ugly conversion routines
 static inline const Point_3 &conv(const Point3D &p) {
@@ -38,57 +44,119 @@ static inline const std::vector<Point_3> &conv(const PointVector &pv) {
   return *reinterpret_cast<const std::vector<Point_3> *>(&pv);
 }
 
+// The k-d tree, with its own copy of the point positions it was built on
+struct Index {
+  std::vector<Point_3> points;
+  Tree tree;
+  Index(const PointVector &pv)
+    : points(conv(pv)),
+      tree(boost::counting_iterator<size_t>(0), boost::counting_iterator<size_t>(points.size()),
+           Splitter(), Tree_traits(Point_map(points.data())))
+  {
+    tree.build();
+  }
+  Distance distance() const {
+    return Distance(Point_map(const_cast<Point_3 *>(points.data())));
+  }
+};
+
+// Moved points are searched by brute force; above this number it is better to rebuild the tree
+static const size_t max_moved = 64;
+
 // Based on CGAL/Point_set_processing_3/internal/Neighbor_query.h
 
 Nearest::Nearest(const PointVector &points, size_t neighbors, double radius)
-  : points(points), neighbors(neighbors), radius(radius)
+  : points(points), neighbors(neighbors), radius(radius), tree(nullptr)
 {
-  const std::vector<Point_3> &pts = conv(points);
-  auto t = new Tree(pts.begin(), pts.end());
-  t->build();
-  tree = reinterpret_cast<void *>(t);
+  rebuild();
 }
 
 Nearest::~Nearest() {
-  delete reinterpret_cast<Tree *>(tree);
+  delete reinterpret_cast<Index *>(tree);
 }
 
-struct Maximum_points_reached_exception : public std::exception { };
+void Nearest::rebuild() {
+  delete reinterpret_cast<Index *>(tree);
+  tree = reinterpret_cast<void *>(new Index(points));
+  moved.clear();
+  is_moved.assign(points.size(), false);
+}
 
-PointVector Nearest::operator()(const Point3D &p) const {
-  PointVector output;
-  if (radius != 0) {
-    // Radius search
-    Sphere fs(conv(p), radius, 0);
-    size_t k = neighbors || std::numeric_limits<size_t>::max();
-    size_t count = 0;
-    try {
-      std::function<void(const Point_3 &)> limited_search =
-        [&](const Point_3 &it) {
-          output.push_back(conv(it));
-          if (++count == k)
-            throw Maximum_points_reached_exception();
-        };
-      auto output_iterator = boost::make_function_output_iterator(limited_search);
-      reinterpret_cast<Tree *>(tree)->search(output_iterator, fs);
-    } catch (const Maximum_points_reached_exception &) {
-    }
+void Nearest::update(size_t i) {
+  if (is_moved[i])
+    return;
+  is_moved[i] = true;
+  moved.push_back(i);
+  if (moved.size() > max_moved)
+    rebuild();
+}
+
+// The (at most) k nearest points within the squared radius (k = 0 means no limit),
+// by increasing distance
+void Nearest::search(const Point3D &p, size_t k, double sqr_radius, Neighbors &result) const {
+  result.clear();
+  const Index &index = *reinterpret_cast<const Index *>(tree);
+  if (sqr_radius == std::numeric_limits<double>::max()) {
+    // KNN search; at most moved.size() of the results are stale
+    Neighbor_search search(index.tree, conv(p), k + moved.size(), 0, true, index.distance());
+    for (const auto &item : search)
+      if (!is_moved[item.first])
+        result.emplace_back(item.second, item.first);
   } else {
-    // KNN search
-    Distance distance;
-    Neighbor_search search(*reinterpret_cast<Tree *>(tree), conv(p), neighbors + 1,
-                           0, true, distance);
-    Search_iterator search_iterator = search.begin();
-    for (size_t i = 0; i < neighbors + 1; ++i) {
-      if(search_iterator == search.end())
-        break; // not enough points
-      output.push_back(conv(search_iterator->first));
-      search_iterator++;
+    // Visit the points by increasing distance, and stop at the first one outside the sphere,
+    // or when enough points are found
+    Incremental_search search(index.tree, conv(p), 0, true, index.distance());
+    for (auto it = search.begin(); it != search.end(); ++it) {
+      if (it->second > sqr_radius || (k && result.size() == k))
+        break;
+      if (!is_moved[it->first])
+        result.emplace_back(it->second, it->first);
     }
   }
+  if (!moved.empty()) {
+    for (auto i : moved) {
+      double d = (points[i] - p).sqrnorm();
+      if (d <= sqr_radius)
+        result.emplace_back(d, i);
+    }
+    std::sort(result.begin(), result.end());
+  }
+  if (k && result.size() > k)
+    result.resize(k);
+}
+
+PointVector Nearest::operator()(const Point3D &p) const {
+  PointVector output;
+  (*this)(p, output);
   return output;
 }
 
+void Nearest::operator()(const Point3D &p, PointVector &output) const {
+  thread_local Neighbors found;
+  if (radius != 0)
+    search(p, neighbors, radius * radius, found); // the search uses squared distances
+  else
+    search(p, neighbors + 1, std::numeric_limits<double>::max(), found);
+  output.clear();
+  for (const auto &item : found)
+    output.push_back(points[item.second]);
+}
+
+void Nearest::operator()(const PointVector &queries, std::vector<PointVector> &output) const {
+  output.resize(queries.size());
+  long n = queries.size(); // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(dynamic, 256)
+  for (long i = 0; i < n; ++i)
+    (*this)(queries[i], output[i]);
+}
+
+void Nearest::within(const Point3D &p, double r, std::vector<size_t> &output) const {
+  Neighbors found;
+  search(p, 0, r * r, found);
+  for (const auto &item : found)
+    output.push_back(item.second);
+}
+
 // Based on CGAL/jet_estimate_normals.h
 
 using Monge_jet_fitting = CGAL::Monge_via_jet_fitting<Kernel,
@@ -96,11 +164,21 @@ using Monge_jet_fitting = CGAL::Monge_via_jet_fitting<Kernel,
                                                       CGAL::Eigen_svd>;
 using Monge_form = Monge_jet_fitting::Monge_form;
 
-JetData fit(const Point3D &p, const Nearest &nearest, size_t degree) {
+// Fits a jet at p, using `samples` and `monge_fit` as workspace
+static JetData fit_at(const Point3D &p, const Nearest &nearest, size_t degree,
+                      PointVector &samples, Monge_jet_fitting &monge_fit) {
   JetData result;
-  auto samples = conv(nearest(p));
-  Monge_jet_fitting monge_fit;
-  auto monge_form = monge_fit(samples.begin(), samples.end(), degree, 2);
+  nearest(p, samples);
+  result.radius = 0;
+  for (const auto &q : samples)
+    result.radius = std::max(result.radius, (q - p).norm());
+  // A polynomial of this degree has (degree + 1) (degree + 2) / 2 coefficients
+  result.valid = samples.size() >= (degree + 1) * (degree + 2) / 2;
+  if (!result.valid)
+    return result;
+  // The samples are read in place, without converting them to a vector of Point_3
+  const Point_3 *first = &conv(samples.front());
+  auto monge_form = monge_fit(first, first + samples.size(), degree, 2);
   result.normal = conv(monge_form.normal_direction());
   result.d_min = conv(monge_form.minimal_principal_direction());
   result.d_max = conv(monge_form.maximal_principal_direction());
@@ -109,6 +187,40 @@ JetData fit(const Point3D &p, const Nearest &nearest, size_t degree) {
   return result;
 }
 
+JetData fit(const Point3D &p, const Nearest &nearest, size_t degree) {
+  PointVector samples;
+  Monge_jet_fitting monge_fit;
+  return fit_at(p, nearest, degree, samples, monge_fit);
+}
+
+std::vector<JetData> fit(const PointVector &points, const Nearest &nearest, size_t degree) {
+  std::vector<JetData> result(points.size());
+  long n = points.size(); // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel
+  {
+    // Every thread has its own neighbor buffer and fitter, reused for all of its points
+    PointVector samples;
+    Monge_jet_fitting monge_fit;
+#pragma omp for schedule(dynamic, 256)
+    for (long i = 0; i < n; ++i)
+      result[i] = fit_at(points[i], nearest, degree, samples, monge_fit);
+  }
+  return result;
+}
+
+void fit(const PointVector &points, const std::vector<size_t> &indices, const Nearest &nearest,
+         std::vector<JetData> &jets, size_t degree) {
+  long n = indices.size();
+#pragma omp parallel
+  {
+    PointVector samples;
+    Monge_jet_fitting monge_fit;
+#pragma omp for schedule(dynamic, 16)
+    for (long i = 0; i < n; ++i)
+      jets[indices[i]] = fit_at(points[indices[i]], nearest, degree, samples, monge_fit);
+  }
+}
+
 }
 
 #endif // USE_JET_FITTING
@@ -3,6 +3,9 @@
 
 #ifdef USE_JET_FITTING
 
+#include <utility>
+#include <vector>
+
 #include <OpenMesh/Core/Geometry/VectorT.hh>
 
 namespace JetWrapper {
@@ -13,17 +16,36 @@ using PointVector = std::vector<Point3D>;
 
 // radius = 0                     means   KNN search
 // radius > 0 and neighbors = 0   means   unlimited search in a fuzzy sphere
-// radius > 0 and neighbors > 0   means   fuzzy sphere search with limited # of elements
+// radius > 0 and neighbors > 0   means   the (at most) `neighbors` nearest points in the sphere
+//
+// The tree is built over the positions the points have at construction.
+// When some of them move, call update() with their indices: these are then searched
+// by brute force (so queries stay exact), until there are enough of them to warrant
+// rebuilding the tree.
 class Nearest {
 public:
   Nearest(const PointVector &points, size_t neighbors = 20, double radius = 0);
   ~Nearest();
   PointVector operator()(const Point3D &p) const;
+  // Same as above, but reuses the storage of `output`; safe to call from several threads
+  void operator()(const Point3D &p, PointVector &output) const;
+  // Neighbors of all query points, computed in parallel
+  void operator()(const PointVector &queries, std::vector<PointVector> &output) const;
+  // Appends the indices of all points within distance r from p
+  void within(const Point3D &p, double r, std::vector<size_t> &output) const;
+  // Notifies that points[i] has changed
+  void update(size_t i);
 
 private:
+  using Neighbors = std::vector<std::pair<double, size_t>>; // (squared distance, index)
+  void search(const Point3D &p, size_t k, double sqr_radius, Neighbors &result) const;
+  void rebuild();
+
   const PointVector &points;
   size_t neighbors;
   double radius;
+  std::vector<size_t> moved;    // points changed since the tree was built
+  std::vector<bool> is_moved;
   void *tree; // to avoid a bunch of CGAL includes
 };
 
@@ -31,10 +53,19 @@ struct JetData {
   Vector3D normal;       // Unit normal vector
   Vector3D d_min, d_max; // Principal curvature directions
   double k_min, k_max;   // Principal curvature values
+  double radius;         // Distance of the farthest sample point
+  bool valid;            // False when there were too few samples for the degree (nothing else is set)
 };
 
 JetData fit(const Point3D &p, const Nearest &nearest, size_t degree = 2);
 
+// Fits a jet at every point, in parallel when OpenMP is enabled
+std::vector<JetData> fit(const PointVector &points, const Nearest &nearest, size_t degree = 2);
+
+// Refits only the jets at the given indices of `points`
+void fit(const PointVector &points, const std::vector<size_t> &indices, const Nearest &nearest,
+         std::vector<JetData> &jets, size_t degree = 2);
+
 }
 
 #endif // USE_JET_FITTING
@@ -1,8 +1,317 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
 #include <QtWidgets/QApplication>
 
+#include <OpenMesh/Core/IO/MeshIO.hh>
+
 #include "MyWindow.h"
 
+// Benchmark meshes are stored with the same precision as in the viewer
+struct BenchmarkTraits : public OpenMesh::DefaultTraits {
+  using Point  = OpenMesh::VectorT<MyViewer::Scalar,3>;
+  using Normal = OpenMesh::VectorT<MyViewer::Scalar,3>;
+};
+
+// A positive number given for a command line option; false (after a message) for anything else
+template <typename T>
+static bool parsePositive(const std::string &option, const char *text, T &value) {
+  char *end;
+  long parsed = std::strtol(text, &end, 10);
+  if (end == text || *end != '\0' || parsed <= 0) {
+    std::cerr << "Invalid value for " << option << ": " << text << std::endl;
+    return false;
+  }
+  value = static_cast<T>(parsed);
+  return true;
+}
+
+// Compares the per-face and the batched closest point queries of the mesh snapshot:
+//   sample-framework --benchmark [--queries N] model...
+// All are timed on the same random points around the model: the batched ones both on ranges
+// of faces and on shuffled lists of faces (as in the cells of the height field), and their results
+// have to agree within a tolerance relative to the bounding box.
+static int benchmark(int argc, char **argv) {
+  using BenchmarkMesh = OpenMesh::TriMesh_ArrayKernelT<BenchmarkTraits>;
+  using Snapshot = MeshSnapshot<MyViewer::Scalar>;
+  using Clock = std::chrono::steady_clock;
+
+  size_t n_queries = 1000;
+  std::vector<std::string> models;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--queries" && i + 1 < argc) {
+      if (!parsePositive(arg, argv[++i], n_queries))
+        return EXIT_FAILURE;
+    } else
+      models.push_back(arg);
+  }
+
+  int errors = 0;
+  for (const auto &model : models) {
+    BenchmarkMesh mesh;
+    if (!OpenMesh::IO::read_mesh(mesh, model) || mesh.n_faces() == 0) {
+      std::cerr << "Could not read " << model << std::endl;
+      ++errors;
+      continue;
+    }
+    mesh.request_face_normals();
+    mesh.update_face_normals();
+    std::vector<int> faces;
+    faces.reserve(mesh.n_faces() * 3);
+    for (auto f : mesh.faces())
+      for (auto v : mesh.fv_range(f))
+        faces.push_back(v.idx());
+    Snapshot snapshot(mesh.points(), mesh.n_vertices(), faces, mesh.face_normals());
+    size_t n_faces = snapshot.n_faces();
+
+    Snapshot::Vector3D box_min = snapshot.point(0), box_max = box_min;
+    for (size_t i = 1; i < snapshot.n_points(); ++i) {
+      box_min.minimize(snapshot.point(i));
+      box_max.maximize(snapshot.point(i));
+    }
+    double diagonal = (box_max - box_min).norm();
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> uniform(-0.25, 1.25);
+    std::vector<Snapshot::Vector3D> queries(n_queries);
+    for (auto &q : queries)
+      for (size_t k = 0; k < 3; ++k)
+        q[k] = box_min[k] + (box_max[k] - box_min[k]) * uniform(rng);
+
+    // The nearest distance for each query, so that none of the work can be optimized away
+    std::vector<double> scalar(n_queries), batched(n_queries);
+    auto start = Clock::now();
+    for (size_t i = 0; i < n_queries; ++i) {
+      double best = std::numeric_limits<double>::max();
+      for (size_t f = 0; f < n_faces; ++f)
+        best = std::min(best, (snapshot.closestPoint(f, queries[i]) - queries[i]).sqrnorm());
+      scalar[i] = std::sqrt(best);
+    }
+    std::chrono::duration<double> scalar_time = Clock::now() - start;
+    start = Clock::now();
+    const size_t block = 64;
+    Snapshot::Vector3D projections[block];
+    for (size_t i = 0; i < n_queries; ++i) {
+      double best = std::numeric_limits<double>::max();
+      for (size_t first = 0; first < n_faces; first += block) {
+        size_t count = std::min(block, n_faces - first);
+        snapshot.closestPoints(first, count, queries[i], projections);
+        for (size_t j = 0; j < count; ++j)
+          best = std::min(best, (projections[j] - queries[i]).sqrnorm());
+      }
+      batched[i] = std::sqrt(best);
+    }
+    std::chrono::duration<double> batched_time = Clock::now() - start;
+    std::vector<int> shuffled(n_faces);
+    for (size_t f = 0; f < n_faces; ++f)
+      shuffled[f] = f;
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    std::vector<double> gathered(n_queries);
+    start = Clock::now();
+    for (size_t i = 0; i < n_queries; ++i) {
+      double best = std::numeric_limits<double>::max();
+      for (size_t first = 0; first < n_faces; first += block) {
+        size_t count = std::min(block, n_faces - first);
+        snapshot.closestPoints(&shuffled[first], count, queries[i], projections);
+        for (size_t j = 0; j < count; ++j)
+          best = std::min(best, (projections[j] - queries[i]).sqrnorm());
+      }
+      gathered[i] = std::sqrt(best);
+    }
+    std::chrono::duration<double> gathered_time = Clock::now() - start;
+
+    // Every single projection is compared, not just the nearest ones
+    double max_error = 0.0;
+    for (size_t i = 0; i < n_queries; ++i) {
+      max_error = std::max(max_error, std::abs(scalar[i] - batched[i]));
+      max_error = std::max(max_error, std::abs(scalar[i] - gathered[i]));
+      for (size_t first = 0; first < n_faces; first += block) {
+        size_t count = std::min(block, n_faces - first);
+        snapshot.closestPoints(first, count, queries[i], projections);
+        for (size_t j = 0; j < count; ++j)
+          max_error = std::max(max_error,
+                               (snapshot.closestPoint(first + j, queries[i]) - projections[j]).norm());
+        snapshot.closestPoints(&shuffled[first], count, queries[i], projections);
+        for (size_t j = 0; j < count; ++j)
+          max_error = std::max(max_error,
+                               (snapshot.closestPoint(shuffled[first + j], queries[i]) - projections[j]).norm());
+      }
+    }
+
+    bool ok = max_error <= 1.0e-9 * diagonal;
+    std::cout << model << ": " << n_faces << " faces, " << n_queries << " queries" << std::endl
+              << "  scalar:   " << scalar_time.count() << " s" << std::endl
+              << "  batched:  " << batched_time.count() << " s ("
+              << scalar_time.count() / batched_time.count() << "x)" << std::endl
+              << "  gathered: " << gathered_time.count() << " s ("
+              << scalar_time.count() / gathered_time.count() << "x)" << std::endl
+              << "  max. deviation: " << max_error << (ok ? "" : " (too large)") << std::endl;
+    if (!ok)
+      ++errors;
+  }
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Support cost of each model, without a display:
+//   sample-framework --estimate model...
+static int estimate(int argc, char **argv) {
+  if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  QApplication app(argc, argv);
+  MyViewer viewer(nullptr);
+  viewer.setAsynchronous(false); // results are needed right away
+  int errors = 0;
+  for (int i = 2; i < argc; ++i) {
+    std::string model = argv[i];
+    auto dot = model.find_last_of('.');
+    bool bezier = dot != std::string::npos && model.substr(dot) == ".bzr";
+    if (!(bezier ? viewer.openBezier(model, false) : viewer.openMesh(model, false))) {
+      std::cerr << "Could not read " << model << std::endl;
+      ++errors;
+      continue;
+    }
+    viewer.calculateSupportTreePoints();
+    std::cout << model << ": " << viewer.describeSupport(viewer.estimateSupport()).toStdString()
+              << std::endl;
+  }
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Comma-separated numbers
+static std::vector<double> parseList(const std::string &list) {
+  std::vector<double> result;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = std::min(list.find(',', start), list.size());
+    if (end > start)
+      result.push_back(std::atof(list.substr(start, end - start).c_str()));
+    start = end + 1;
+  }
+  return result;
+}
+
+// Support estimates on a grid of parameters, as a tab-separated table:
+//   sample-framework --sweep [--angles A,...] [--densities D,...] [--coefficients C,...] model...
+// Angles are in degrees; parameters not given keep their default value.
+static int sweep(int argc, char **argv) {
+  if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  QApplication app(argc, argv);
+  MyViewer viewer(nullptr);
+  viewer.setAsynchronous(false); // results are needed right away
+
+  std::vector<double> angles = { viewer.getAngleLimit() };
+  std::vector<double> densities = { viewer.getGridDensity() };
+  std::vector<double> coefficients = { viewer.getDiameterCoefficient() };
+  std::vector<std::string> models;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--angles" && i + 1 < argc) {
+      angles = parseList(argv[++i]);
+      for (auto &a : angles)
+        a *= M_PI / 180;
+    } else if (arg == "--densities" && i + 1 < argc)
+      densities = parseList(argv[++i]);
+    else if (arg == "--coefficients" && i + 1 < argc)
+      coefficients = parseList(argv[++i]);
+    else
+      models.push_back(arg);
+  }
+
+  int errors = 0;
+  std::cout << "model\tangle\tdensity\tcoefficient\tstruts\tcontacts\ttotal_length\tvolume"
+            << "\ttree_ms\testimate_ms" << std::endl;
+  for (const auto &model : models) {
+    auto dot = model.find_last_of('.');
+    bool bezier = dot != std::string::npos && model.substr(dot) == ".bzr";
+    if (!(bezier ? viewer.openBezier(model, false) : viewer.openMesh(model, false))) {
+      std::cerr << "Could not read " << model << std::endl;
+      ++errors;
+      continue;
+    }
+    for (const auto &r : viewer.sweepSupport(angles, densities, coefficients))
+      std::cout << model << '\t' << r.angle * 180 / M_PI << '\t' << r.density << '\t'
+                << r.coefficient << '\t' << r.estimate.struts << '\t' << r.estimate.contacts << '\t'
+                << r.estimate.total_length << '\t' << r.estimate.volume << '\t'
+                << r.tree_seconds * 1000 << '\t' << r.estimate_seconds * 1000 << std::endl;
+  }
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#ifdef USE_OFFSCREEN
+
+// Headless batch rendering, no display is needed:
+//   sample-framework --thumbnails [--size N] [--views N] [--mode M] [--no-supports] model...
+// Writes model-0.png, model-1.png, ... next to each model,
+// where M is one of plain, mean, slicing, isophotes, environment.
+static int thumbnails(int argc, char **argv) {
+  if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  QApplication app(argc, argv);
+
+  int size = 256;
+  size_t views = 4;
+  std::string mode = "plain";
+  bool supports = true;
+  std::vector<std::string> models;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--size" && i + 1 < argc) {
+      if (!parsePositive(arg, argv[++i], size))
+        return EXIT_FAILURE;
+    } else if (arg == "--views" && i + 1 < argc) {
+      if (!parsePositive(arg, argv[++i], views))
+        return EXIT_FAILURE;
+    } else if (arg == "--mode" && i + 1 < argc)
+      mode = argv[++i];
+    else if (arg == "--no-supports")
+      supports = false;
+    else
+      models.push_back(arg);
+  }
+
+  MyViewer viewer(nullptr);
+  viewer.setAsynchronous(false); // results are needed right away
+  int errors = 0;
+  for (const auto &model : models) {
+    auto dot = model.find_last_of('.');
+    bool bezier = dot != std::string::npos && model.substr(dot) == ".bzr";
+    bool ok = bezier ? viewer.openBezier(model) : viewer.openMesh(model);
+    if (ok && supports) {
+      viewer.calculateSupportTreePoints();
+      std::cout << model << ": " << viewer.describeSupport(viewer.estimateSupport()).toStdString()
+                << std::endl;
+      viewer.addTreeGeometry();
+    }
+    if (!ok || !viewer.renderViews(model.substr(0, dot), views, size, mode)) {
+      std::cerr << "Could not render " << model << std::endl;
+      ++errors;
+    }
+  }
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif // USE_OFFSCREEN
+
 int main(int argc, char **argv) {
+  if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0)
+    return benchmark(argc, argv);
+  if (argc > 1 && std::strcmp(argv[1], "--estimate") == 0)
+    return estimate(argc, argv);
+  if (argc > 1 && std::strcmp(argv[1], "--sweep") == 0)
+    return sweep(argc, argv);
+#ifdef USE_OFFSCREEN
+  if (argc > 1 && std::strcmp(argv[1], "--thumbnails") == 0)
+    return thumbnails(argc, argv);
+#endif
   QApplication app(argc, argv);
   MyWindow window(&app);
   window.show();
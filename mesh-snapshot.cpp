@@ -0,0 +1,381 @@
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <limits>
+
+#include "mesh-snapshot.h"
+
+template <typename Scalar>
+MeshSnapshot<Scalar>::MeshSnapshot(const StoredVector *points, size_t n_points,
+                                   const std::vector<int> &faces, const StoredVector *face_normals)
+  : faces(faces)
+{
+  this->points.reserve(n_points);
+  for (size_t i = 0; i < n_points; ++i)
+    this->points.push_back(Vector3D(points[i]));
+
+  size_t n = n_faces();
+  normals.reserve(n);
+  B.reserve(n); E0.reserve(n); E1.reserve(n);
+  a.reserve(n); b.reserve(n); c.reserve(n); det.reserve(n);
+  for (size_t f = 0; f < n; ++f) {
+    normals.push_back(Vector3D(face_normals[f]));
+    Vector3D q1(points[faces[3*f]]), q2(points[faces[3*f+1]]), q3(points[faces[3*f+2]]);
+    Vector3D e0 = q2 - q1, e1 = q3 - q1;
+    B.push_back(q1); E0.push_back(e0); E1.push_back(e1);
+    double ea = e0 | e0, eb = e0 | e1, ec = e1 | e1;
+    a.push_back(ea); b.push_back(eb); c.push_back(ec);
+    det.push_back(ea * ec - eb * eb);
+  }
+
+  double diagonal = 0.0;
+  std::vector<Vector3D> centroids(n);
+  for (size_t f = 0; f < n; ++f)
+    centroids[f] = (this->points[faces[3*f]] + this->points[faces[3*f+1]] + this->points[faces[3*f+2]]) / 3;
+  bvh_faces.resize(n);
+  for (size_t f = 0; f < n; ++f)
+    bvh_faces[f] = f;
+  if (n > 0) {
+    bvh.reserve(2 * n);
+    bvh.emplace_back();
+    buildHierarchy(0, 0, n, centroids);
+    diagonal = (Vector3D(bvh[0].max) - Vector3D(bvh[0].min)).norm();
+  }
+  tolerance = diagonal * 1.0e-9;
+}
+
+template <typename Scalar>
+void MeshSnapshot<Scalar>::buildHierarchy(size_t node, size_t first, size_t count,
+                                          std::vector<Vector3D> &centroids) {
+  Vector3D min(std::numeric_limits<double>::max()), max(-std::numeric_limits<double>::max());
+  Vector3D cmin = min, cmax = max;
+  for (size_t i = first; i < first + count; ++i) {
+    size_t f = bvh_faces[i];
+    for (size_t k = 0; k < 3; ++k) {
+      min.minimize(points[faces[3*f+k]]);
+      max.maximize(points[faces[3*f+k]]);
+    }
+    cmin.minimize(centroids[f]);
+    cmax.maximize(centroids[f]);
+  }
+  for (size_t k = 0; k < 3; ++k) {
+    bvh[node].min[k] = min[k];
+    bvh[node].max[k] = max[k];
+  }
+  bvh[node].first = first;
+  bvh[node].count = count;
+  bvh[node].child = -1;
+  if (count <= 4)
+    return;
+
+  // Median split along the longest axis of the centroids
+  Vector3D extent = cmax - cmin;
+  size_t axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+  size_t half = count / 2;
+  std::nth_element(bvh_faces.begin() + first, bvh_faces.begin() + first + half,
+                   bvh_faces.begin() + first + count,
+                   [&](size_t f1, size_t f2) { return centroids[f1][axis] < centroids[f2][axis]; });
+  int child = bvh.size();
+  bvh[node].child = child;
+  bvh.emplace_back();
+  bvh.emplace_back();
+  buildHierarchy(child, first, half, centroids);
+  buildHierarchy(child + 1, first + half, count - half, centroids);
+}
+
+template <typename Scalar>
+typename MeshSnapshot<Scalar>::RayHit
+MeshSnapshot<Scalar>::castDown(const Vector3D &origin, double plate) const {
+  RayHit hit = { -1, plate };
+  if (bvh.empty())
+    return hit;
+  double x = origin[0], y = origin[1], top = origin[2] - tolerance;
+  size_t stack[64];
+  size_t size = 0;
+  stack[size++] = 0;
+  while (size > 0) {
+    const Node &node = bvh[stack[--size]];
+    if (x < node.min[0] || x > node.max[0] || y < node.min[1] || y > node.max[1] ||
+        node.min[2] >= top || node.max[2] < hit.z)
+      continue;
+    if (node.child >= 0) {
+      // The child reaching higher is visited first, as its hits can prune the other
+      size_t c0 = node.child, c1 = node.child + 1;
+      if (bvh[c0].max[2] > bvh[c1].max[2])
+        std::swap(c0, c1);
+      stack[size++] = c0;
+      stack[size++] = c1;
+      continue;
+    }
+    for (size_t i = node.first; i < node.first + node.count; ++i) {
+      size_t f = bvh_faces[i];
+      // Solve (x, y) = B + s E0 + t E1 in the XY plane
+      double ex0 = E0.x[f], ey0 = E0.y[f], ex1 = E1.x[f], ey1 = E1.y[f];
+      double det2 = ex0 * ey1 - ey0 * ex1;
+      if (det2 == 0.0)
+        continue; // vertical face
+      double dx = x - B.x[f], dy = y - B.y[f];
+      double s = (dx * ey1 - dy * ex1) / det2, t = (ex0 * dy - ey0 * dx) / det2;
+      if (s < 0.0 || t < 0.0 || s + t > 1.0)
+        continue;
+      double z = B.z[f] + s * E0.z[f] + t * E1.z[f];
+      if (z < top && z >= hit.z) {
+        hit.face = f;
+        hit.z = z;
+      }
+    }
+  }
+  return hit;
+}
+
+template <typename Scalar>
+void MeshSnapshot<Scalar>::castDown(const std::vector<Vector3D> &origins, double plate,
+                                    std::vector<RayHit> &hits) const {
+  hits.resize(origins.size());
+  long n = origins.size(); // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(dynamic, 64)
+  for (long i = 0; i < n; ++i)
+    hits[i] = castDown(origins[i], plate);
+}
+
+template <typename Scalar>
+typename MeshSnapshot<Scalar>::Vector3D
+MeshSnapshot<Scalar>::closestPoint(size_t f, const Vector3D &p) const {
+  // As in Schneider, Eberly: Geometric Tools for Computer Graphics, Morgan Kaufmann, 2003.
+  // Section 10.3.2, pp. 376-382 (with my corrections)
+  Vector3D base = B[f], e0 = E0[f], e1 = E1[f], D = base - p;
+  double a = this->a[f], b = this->b[f], c = this->c[f], det = this->det[f];
+  double d = e0 | D, e = e1 | D;
+  double s = b * e - c * d, t = b * d - a * e;
+  if (s + t <= det) {
+    if (s < 0) {
+      if (t < 0) {
+        // Region 4
+        if (e < 0) {
+          s = 0.0;
+          t = (-e >= c ? 1.0 : -e / c);
+        } else if (d < 0) {
+          t = 0.0;
+          s = (-d >= a ? 1.0 : -d / a);
+        } else {
+          s = 0.0;
+          t = 0.0;
+        }
+      } else {
+        // Region 3
+        s = 0.0;
+        t = (e >= 0.0 ? 0.0 : (-e >= c ? 1.0 : -e / c));
+      }
+    } else if (t < 0) {
+      // Region 5
+      t = 0.0;
+      s = (d >= 0.0 ? 0.0 : (-d >= a ? 1.0 : -d / a));
+    } else {
+      // Region 0
+      double invDet = 1.0 / det;
+      s *= invDet;
+      t *= invDet;
+    }
+  } else {
+    if (s < 0) {
+      // Region 2
+      double tmp0 = b + d, tmp1 = c + e;
+      if (tmp1 > tmp0) {
+        double numer = tmp1 - tmp0;
+        double denom = a - 2 * b + c;
+        s = (numer >= denom ? 1.0 : numer / denom);
+        t = 1.0 - s;
+      } else {
+        s = 0.0;
+        t = (tmp1 <= 0.0 ? 1.0 : (e >= 0.0 ? 0.0 : -e / c));
+      }
+    } else if (t < 0) {
+      // Region 6
+      double tmp0 = b + e, tmp1 = a + d;
+      if (tmp1 > tmp0) {
+        double numer = tmp1 - tmp0;
+        double denom = c - 2 * b + a;
+        t = (numer >= denom ? 1.0 : numer / denom);
+        s = 1.0 - t;
+      } else {
+        t = 0.0;
+        s = (tmp1 <= 0.0 ? 1.0 : (d >= 0.0 ? 0.0 : -d / a));
+      }
+    } else {
+      // Region 1
+      double numer = c + e - b - d;
+      if (numer <= 0) {
+        s = 0;
+      } else {
+        double denom = a - 2 * b + c;
+        s = (numer >= denom ? 1.0 : numer / denom);
+      }
+      t = 1.0 - s;
+    }
+  }
+  return base + e0 * s + e1 * t;
+}
+
+// Branchless version of the above: the projection onto the plane if it is inside the triangle,
+// otherwise the best of the projections onto the three (closed) edges.
+// Quadratic terms are compared without the constant |D|^2.
+
+static inline double clamp01(double x) {
+  return x > 0.0 ? (x < 1.0 ? x : 1.0) : 0.0; // NaN (degenerate edge) goes to 0
+}
+
+static inline void closestParameters(double a, double b, double c, double det, double d, double e,
+                                     double &s, double &t) {
+  // Edge t = 0
+  s = clamp01(-d / a);
+  t = 0.0;
+  double q = (a * s + 2 * d) * s;
+  // Edge s = 0
+  double t2 = clamp01(-e / c);
+  double q2 = (c * t2 + 2 * e) * t2;
+  bool better = q2 < q;
+  s = better ? 0.0 : s;
+  t = better ? t2 : t;
+  q = better ? q2 : q;
+  // Edge s + t = 1
+  double s3 = clamp01((c + e - b - d) / (a - 2 * b + c)), t3 = 1.0 - s3;
+  double q3 = (a * s3 + 2 * d) * s3 + (c * t3 + 2 * e) * t3 + 2 * b * s3 * t3;
+  better = q3 < q;
+  s = better ? s3 : s;
+  t = better ? t3 : t;
+  // Interior
+  double s0 = b * e - c * d, t0 = b * d - a * e;
+  bool inside = det > 0 && s0 >= 0 && t0 >= 0 && s0 + t0 <= det;
+  s = inside ? s0 / det : s;
+  t = inside ? t0 / det : t;
+}
+
+#ifdef __AVX2__
+
+// 4 consecutive values, converted to double
+static inline __m256d load4(const double *x) { return _mm256_loadu_pd(x); }
+static inline __m256d load4(const float *x) { return _mm256_cvtps_pd(_mm_loadu_ps(x)); }
+// The values at 4 indices, converted to double
+static inline __m256d gather4(const double *x, __m128i i) { return _mm256_i32gather_pd(x, i, 8); }
+static inline __m256d gather4(const float *x, __m128i i) { return _mm256_cvtps_pd(_mm_i32gather_ps(x, i, 4)); }
+
+// Same as closestParameters(), in 4 lanes
+static inline void closestParameters4(__m256d a, __m256d b, __m256d c, __m256d det,
+                                      __m256d d, __m256d e, __m256d &s, __m256d &t) {
+  const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+  // max_pd returns its second argument for NaN, as clamp01()
+  auto clamp01 = [&](__m256d x) { return _mm256_min_pd(_mm256_max_pd(x, zero), one); };
+  auto neg = [&](__m256d x) { return _mm256_sub_pd(zero, x); };
+  auto mul = [](__m256d x, __m256d y) { return _mm256_mul_pd(x, y); };
+  auto add = [](__m256d x, __m256d y) { return _mm256_add_pd(x, y); };
+
+  // Edge t = 0
+  s = clamp01(_mm256_div_pd(neg(d), a));
+  t = zero;
+  __m256d q = mul(add(mul(a, s), mul(two, d)), s);
+  // Edge s = 0
+  __m256d t2 = clamp01(_mm256_div_pd(neg(e), c));
+  __m256d q2 = mul(add(mul(c, t2), mul(two, e)), t2);
+  __m256d better = _mm256_cmp_pd(q2, q, _CMP_LT_OQ);
+  s = _mm256_blendv_pd(s, zero, better);
+  t = _mm256_blendv_pd(t, t2, better);
+  q = _mm256_blendv_pd(q, q2, better);
+  // Edge s + t = 1
+  __m256d numer = _mm256_sub_pd(add(c, e), add(b, d));
+  __m256d denom = _mm256_sub_pd(add(a, c), mul(two, b));
+  __m256d s3 = clamp01(_mm256_div_pd(numer, denom)), t3 = _mm256_sub_pd(one, s3);
+  __m256d q3 = add(add(mul(add(mul(a, s3), mul(two, d)), s3), mul(add(mul(c, t3), mul(two, e)), t3)),
+                   mul(mul(two, b), mul(s3, t3)));
+  better = _mm256_cmp_pd(q3, q, _CMP_LT_OQ);
+  s = _mm256_blendv_pd(s, s3, better);
+  t = _mm256_blendv_pd(t, t3, better);
+  // Interior
+  __m256d s0 = _mm256_sub_pd(mul(b, e), mul(c, d)), t0 = _mm256_sub_pd(mul(b, d), mul(a, e));
+  __m256d inside = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(det, zero, _CMP_GT_OQ),
+                                               _mm256_cmp_pd(s0, zero, _CMP_GE_OQ)),
+                                 _mm256_and_pd(_mm256_cmp_pd(t0, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_pd(add(s0, t0), det, _CMP_LE_OQ)));
+  s = _mm256_blendv_pd(s, _mm256_div_pd(s0, det), inside);
+  t = _mm256_blendv_pd(t, _mm256_div_pd(t0, det), inside);
+}
+
+#endif // __AVX2__
+
+// Faces first, first + 1, ...
+struct FaceRange {
+  size_t first;
+  size_t operator[](size_t k) const { return first + k; }
+#ifdef __AVX2__
+  template <typename T>
+  __m256d load4(const std::vector<T> &x, size_t k) const { return ::load4(&x[first + k]); }
+#endif
+};
+
+// Faces listed by their indices
+struct FaceList {
+  const int *faces;
+  size_t operator[](size_t k) const { return faces[k]; }
+#ifdef __AVX2__
+  template <typename T>
+  __m256d load4(const std::vector<T> &x, size_t k) const {
+    return gather4(x.data(), _mm_loadu_si128(reinterpret_cast<const __m128i *>(faces + k)));
+  }
+#endif
+};
+
+template <typename Scalar>
+void MeshSnapshot<Scalar>::closestPoints(size_t first, size_t count, const Vector3D &p,
+                                         Vector3D *result) const {
+  projectFaces(FaceRange{first}, count, p, result);
+}
+
+template <typename Scalar>
+void MeshSnapshot<Scalar>::closestPoints(const int *faces, size_t count, const Vector3D &p,
+                                         Vector3D *result) const {
+  projectFaces(FaceList{faces}, count, p, result);
+}
+
+template <typename Scalar>
+template <typename Faces>
+void MeshSnapshot<Scalar>::projectFaces(const Faces &faces, size_t count, const Vector3D &p,
+                                        Vector3D *result) const {
+  size_t k = 0;
+#ifdef __AVX2__
+  const __m256d px = _mm256_set1_pd(p[0]), py = _mm256_set1_pd(p[1]), pz = _mm256_set1_pd(p[2]);
+  for (; k + 4 <= count; k += 4, result += 4) {
+    auto load = [&](const std::vector<Scalar> &x) { return faces.load4(x, k); };
+    __m256d bx = load(B.x), by = load(B.y), bz = load(B.z);
+    __m256d e0x = load(E0.x), e0y = load(E0.y), e0z = load(E0.z);
+    __m256d e1x = load(E1.x), e1y = load(E1.y), e1z = load(E1.z);
+    __m256d dx = _mm256_sub_pd(bx, px), dy = _mm256_sub_pd(by, py), dz = _mm256_sub_pd(bz, pz);
+    auto dot = [](__m256d x0, __m256d y0, __m256d z0, __m256d x1, __m256d y1, __m256d z1) {
+      return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x0, x1), _mm256_mul_pd(y0, y1)),
+                           _mm256_mul_pd(z0, z1));
+    };
+    __m256d s, t;
+    closestParameters4(load(a), load(b), load(c), load(det),
+                       dot(e0x, e0y, e0z, dx, dy, dz), dot(e1x, e1y, e1z, dx, dy, dz), s, t);
+    auto coordinate = [&](__m256d base, __m256d u, __m256d v) {
+      return _mm256_add_pd(base, _mm256_add_pd(_mm256_mul_pd(u, s), _mm256_mul_pd(v, t)));
+    };
+    alignas(32) double x[4], y[4], z[4];
+    _mm256_store_pd(x, coordinate(bx, e0x, e1x));
+    _mm256_store_pd(y, coordinate(by, e0y, e1y));
+    _mm256_store_pd(z, coordinate(bz, e0z, e1z));
+    for (size_t i = 0; i < 4; ++i)
+      result[i] = Vector3D(x[i], y[i], z[i]);
+  }
+#endif
+  for (; k < count; ++k, ++result) {
+    size_t f = faces[k];
+    Vector3D base = B[f], e0 = E0[f], e1 = E1[f], D = base - p;
+    double s, t;
+    closestParameters(a[f], b[f], c[f], det[f], e0 | D, e1 | D, s, t);
+    *result = base + e0 * s + e1 * t;
+  }
+}
+
+template class MeshSnapshot<float>;
+template class MeshSnapshot<double>;
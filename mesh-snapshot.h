@@ -0,0 +1,79 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <vector>
+
+#include <OpenMesh/Core/Geometry/VectorT.hh>
+
+// Read-only copy of the mesh geometry, laid out for the support analysis loops.
+// Everything is stored as structure of arrays, including the per-face terms
+// of the closest point computation, which are set up once instead of at every query.
+// Data is stored with the precision of the mesh (Scalar is float or double),
+// but the interface and all computations use double precision.
+template <typename Scalar>
+class MeshSnapshot {
+public:
+  using Vector3D = OpenMesh::VectorT<double,3>;
+  using StoredVector = OpenMesh::VectorT<Scalar,3>;
+
+  // `faces` holds three vertex indices per face
+  MeshSnapshot(const StoredVector *points, size_t n_points, const std::vector<int> &faces,
+               const StoredVector *face_normals);
+
+  size_t n_points() const { return points.size(); }
+  size_t n_faces() const { return faces.size() / 3; }
+  Vector3D point(size_t i) const { return points[i]; }
+  Vector3D normal(size_t f) const { return normals[f]; }
+  int vertex(size_t f, size_t k) const { return faces[3*f+k]; }
+
+  // The point of face f closest to p
+  Vector3D closestPoint(size_t f, const Vector3D &p) const;
+
+  // The points of faces first, ..., first + count - 1 closest to p, written into `result`.
+  // Selects the region without branches, and (when compiled with AVX2) handles 4 faces at once;
+  // agrees with closestPoint() up to rounding.
+  void closestPoints(size_t first, size_t count, const Vector3D &p, Vector3D *result) const;
+  // The same for the faces faces[0], ..., faces[count - 1], e.g. those of a height field cell
+  void closestPoints(const int *faces, size_t count, const Vector3D &p, Vector3D *result) const;
+
+  // First face hit by a vertical ray going down from a point
+  struct RayHit {
+    int face;   // -1 when only the plate is hit
+    double z;   // height of the hit
+  };
+  // Faces at or above `plate` are hit, if they are strictly below the origin
+  RayHit castDown(const Vector3D &origin, double plate) const;
+  // The same for every origin, in parallel when OpenMP is enabled
+  void castDown(const std::vector<Vector3D> &origins, double plate, std::vector<RayHit> &hits) const;
+
+private:
+  struct Coordinates {
+    std::vector<Scalar> x, y, z;
+    size_t size() const { return x.size(); }
+    void reserve(size_t n) { x.reserve(n); y.reserve(n); z.reserve(n); }
+    void push_back(const Vector3D &p) { x.push_back(p[0]); y.push_back(p[1]); z.push_back(p[2]); }
+    Vector3D operator[](size_t i) const { return Vector3D(x[i], y[i], z[i]); }
+  };
+
+  Coordinates points;
+  std::vector<int> faces;
+  Coordinates normals;
+  // Per face: the first vertex B, the edges E0 = q2 - B and E1 = q3 - B,
+  // and the terms a = E0.E0, b = E0.E1, c = E1.E1, det = ac - b^2
+  Coordinates B, E0, E1;
+  std::vector<Scalar> a, b, c, det;
+  // Both closestPoints(); `Faces` gives the k-th face, and loads the data of faces k, ..., k + 3
+  template <typename Faces>
+  void projectFaces(const Faces &faces, size_t count, const Vector3D &p, Vector3D *result) const;
+
+  // Bounding volume hierarchy of the faces, with at most 4 faces in a leaf
+  struct Node {
+    double min[3], max[3];
+    int child;            // the children are child and child + 1; -1 for leaves
+    size_t first, count;  // faces bvh_faces[first, first + count) for leaves
+  };
+  void buildHierarchy(size_t node, size_t first, size_t count, std::vector<Vector3D> &centroids);
+  std::vector<Node> bvh;
+  std::vector<size_t> bvh_faces;
+  double tolerance;       // hits closer than this below the origin are ignored
+};
@@ -0,0 +1,73 @@
+#ifdef USE_OFFSCREEN
+
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "offscreen-context.h"
+
+OffscreenContext::OffscreenContext(int width, int height)
+    : w(width), h(height), display(EGL_NO_DISPLAY), surface(EGL_NO_SURFACE), context(EGL_NO_CONTEXT)
+{
+    // Prefer a platform that does not need a display server
+    EGLDisplay dpy = EGL_NO_DISPLAY;
+    auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (getPlatformDisplay)
+        dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (dpy == EGL_NO_DISPLAY)
+        dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, nullptr, nullptr))
+        return;
+    display = dpy;
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint n_configs;
+    if (!eglChooseConfig(dpy, config_attribs, &config, 1, &n_configs) || n_configs < 1)
+        return;
+
+    const EGLint pbuffer_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    surface = eglCreatePbufferSurface(dpy, config, pbuffer_attribs);
+    if (surface == EGL_NO_SURFACE)
+        return;
+
+    // The drawing code uses the fixed-function pipeline,
+    // so we need desktop OpenGL with the default (compatibility) profile
+    if (!eglBindAPI(EGL_OPENGL_API))
+        return;
+    context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, nullptr);
+}
+
+OffscreenContext::~OffscreenContext() {
+    if (display == EGL_NO_DISPLAY)
+        return;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context != EGL_NO_CONTEXT)
+        eglDestroyContext(display, context);
+    if (surface != EGL_NO_SURFACE)
+        eglDestroySurface(display, surface);
+    eglTerminate(display);
+}
+
+bool OffscreenContext::isValid() const {
+    return context != EGL_NO_CONTEXT;
+}
+
+bool OffscreenContext::makeCurrent() {
+    return isValid() && eglMakeCurrent(display, surface, surface, context);
+}
+
+void OffscreenContext::doneCurrent() {
+    if (display != EGL_NO_DISPLAY)
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+#endif // USE_OFFSCREEN
@@ -0,0 +1,26 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#ifdef USE_OFFSCREEN
+
+// An OpenGL (compatibility profile) context rendering into a pbuffer,
+// created through EGL without any window system.
+// On Mesa this uses the surfaceless platform, so it works on machines
+// without a display, falling back to the llvmpipe software rasterizer
+// when there is no GPU.
+class OffscreenContext {
+public:
+    OffscreenContext(int width, int height);
+    ~OffscreenContext();
+    bool isValid() const;
+    bool makeCurrent();
+    void doneCurrent();
+    int width() const { return w; }
+    int height() const { return h; }
+
+private:
+    int w, h;
+    void *display, *surface, *context; // to avoid the EGL (and X11) includes
+};
+
+#endif // USE_OFFSCREEN
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
+#include "orientation.h"
+
+namespace Orientation {
+
+// Faces with similar normals, with the sums needed for their overhang area and volume:
+// for the faces, with area A, unit normal n and centroid c, below the lowest point m
+// the volume is sum -A (n.u) (c.u - m) = -u^T (sum A n c^T) u + m (sum A n).u
+struct NormalBin {
+  double area = 0.0;
+  Vector3D normal = Vector3D(0.0, 0.0, 0.0); // sum A n
+  double moment[3][3] = {};                  // sum A n c^T
+};
+
+// Octahedral map of unit vectors onto a resolution x resolution grid
+static const size_t resolution = 64;
+
+static size_t normalBin(const Vector3D &n) {
+  double l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+  double x = n[0] / l1, y = n[1] / l1;
+  if (n[2] < 0) {
+    double fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+    double fy = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+    x = fx;
+    y = fy;
+  }
+  size_t i = std::min((size_t)((x + 1) / 2 * resolution), resolution - 1);
+  size_t j = std::min((size_t)((y + 1) / 2 * resolution), resolution - 1);
+  return j * resolution + i;
+}
+
+// The points in spatially coherent blocks, with their bounding boxes,
+// so that most of them can be skipped when looking for the lowest one
+class PointBlocks {
+public:
+  PointBlocks(const PointVector &points) {
+    Vector3D box_min = points[0], box_max = points[0];
+    for (const auto &p : points) {
+      box_min.minimize(p);
+      box_max.maximize(p);
+    }
+    // Morton order
+    std::vector<std::pair<uint32_t, size_t>> order(points.size());
+    Vector3D extent = box_max - box_min;
+    for (size_t i = 0; i < points.size(); ++i) {
+      uint32_t code = 0;
+      for (size_t k = 0; k < 3; ++k) {
+        double t = extent[k] > 0 ? (points[i][k] - box_min[k]) / extent[k] : 0.0;
+        uint32_t q = std::min((uint32_t)(t * 1024), (uint32_t)1023);
+        for (size_t bit = 0; bit < 10; ++bit)
+          code |= ((q >> bit) & 1) << (3 * bit + k);
+      }
+      order[i] = { code, i };
+    }
+    std::sort(order.begin(), order.end());
+    for (const auto &o : order) {
+      x.push_back(points[o.second][0]);
+      y.push_back(points[o.second][1]);
+      z.push_back(points[o.second][2]);
+    }
+    for (size_t first = 0; first < points.size(); first += size) {
+      size_t last = std::min(first + size, points.size());
+      Vector3D bmin(x[first], y[first], z[first]), bmax = bmin;
+      for (size_t i = first; i < last; ++i) {
+        bmin.minimize(Vector3D(x[i], y[i], z[i]));
+        bmax.maximize(Vector3D(x[i], y[i], z[i]));
+      }
+      min.push_back(bmin);
+      max.push_back(bmax);
+    }
+  }
+
+  // The smallest height p.up
+  double lowest(const Vector3D &up) const {
+    size_t n = min.size();
+    std::vector<double> bound(n);
+    for (size_t b = 0; b < n; ++b) {
+      bound[b] = 0.0;
+      for (size_t k = 0; k < 3; ++k)
+        bound[b] += up[k] * (up[k] >= 0 ? min[b][k] : max[b][k]);
+    }
+    // Start from the most promising block, then scan only those that can be lower
+    size_t start = std::min_element(bound.begin(), bound.end()) - bound.begin();
+    double result = std::numeric_limits<double>::max();
+    auto scan = [&](size_t b) {
+      size_t last = std::min((b + 1) * size, x.size());
+      for (size_t i = b * size; i < last; ++i)
+        result = std::min(result, x[i] * up[0] + y[i] * up[1] + z[i] * up[2]);
+    };
+    scan(start);
+    for (size_t b = 0; b < n; ++b)
+      if (b != start && bound[b] < result)
+        scan(b);
+    return result;
+  }
+
+private:
+  static const size_t size = 64;
+  std::vector<double> x, y, z;
+  std::vector<Vector3D> min, max;
+};
+
+// Directions spread evenly on the sphere (Fibonacci lattice)
+static PointVector sphereSamples(size_t n) {
+  PointVector result(n);
+  double golden = M_PI * (3.0 - std::sqrt(5.0));
+  for (size_t i = 0; i < n; ++i) {
+    double z = 1.0 - (2.0 * i + 1.0) / n, r = std::sqrt(1.0 - z * z);
+    result[i] = Vector3D(r * std::cos(golden * i), r * std::sin(golden * i), z);
+  }
+  return result;
+}
+
+std::vector<Candidate> rank(const PointVector &points, const std::vector<int> &triangles,
+                            double angle_limit, double column_area,
+                            size_t samples, size_t refined) {
+  size_t n_points = points.size(), n_faces = triangles.size() / 3;
+  if (n_points == 0 || n_faces == 0)
+    return {};
+  // A face is an overhang when n.up <= -sin(angle_limit)
+  double threshold = -std::sin(angle_limit);
+
+  std::vector<double> areas(n_faces);
+  PointVector normals(n_faces), centroids(n_faces);
+  std::vector<NormalBin> bins(resolution * resolution);
+  for (size_t f = 0; f < n_faces; ++f) {
+    const auto &p0 = points[triangles[3*f]], &p1 = points[triangles[3*f+1]], &p2 = points[triangles[3*f+2]];
+    Vector3D n = (p1 - p0) % (p2 - p0);
+    double length = n.norm();
+    areas[f] = length / 2;
+    normals[f] = length > 0 ? n / length : Vector3D(0.0, 0.0, 0.0);
+    centroids[f] = (p0 + p1 + p2) / 3;
+    if (length == 0)
+      continue;
+    auto &bin = bins[normalBin(normals[f])];
+    bin.area += areas[f];
+    bin.normal += normals[f] * areas[f];
+    for (size_t i = 0; i < 3; ++i)
+      for (size_t j = 0; j < 3; ++j)
+        bin.moment[i][j] += areas[f] * normals[f][i] * centroids[f][j];
+  }
+  bins.erase(std::remove_if(bins.begin(), bins.end(), [](const NormalBin &b) { return b.area == 0; }),
+             bins.end());
+
+  // Neighbors of the vertices, for the local minima
+  std::vector<size_t> offsets(n_points + 1, 0), neighbors(6 * n_faces);
+  for (auto v : triangles)
+    offsets[v+1] += 2;
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  {
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t f = 0; f < n_faces; ++f)
+      for (size_t k = 0; k < 3; ++k) {
+        int v = triangles[3*f+k];
+        neighbors[next[v]++] = triangles[3*f+(k+1)%3];
+        neighbors[next[v]++] = triangles[3*f+(k+2)%3];
+      }
+  }
+
+  PointBlocks blocks(points);
+
+  // Fast pass: overhang volume from the normal bins
+  PointVector directions = sphereSamples(samples);
+  std::vector<double> estimates(samples);
+  long n = samples; // OpenMP 2.0 (MSVC) needs a signed loop variable
+#pragma omp parallel for schedule(dynamic, 16)
+  for (long i = 0; i < n; ++i) {
+    const Vector3D &u = directions[i];
+    double lowest = blocks.lowest(u), volume = 0.0;
+    for (const auto &bin : bins) {
+      double nu = bin.normal | u;
+      if (nu > threshold * bin.area) // the mean normal is not steep enough
+        continue;
+      double quadratic = 0.0;
+      for (size_t j = 0; j < 3; ++j)
+        for (size_t k = 0; k < 3; ++k)
+          quadratic += u[j] * bin.moment[j][k] * u[k];
+      volume += lowest * nu - quadratic;
+    }
+    estimates[i] = volume;
+  }
+
+  // Exact pass on the best ones, and on the current orientation
+  std::vector<size_t> order(samples);
+  std::iota(order.begin(), order.end(), 0);
+  refined = std::min(refined, samples);
+  std::partial_sort(order.begin(), order.begin() + refined, order.end(),
+                    [&](size_t a, size_t b) { return estimates[a] < estimates[b]; });
+  std::vector<Candidate> result;
+  for (size_t i = 0; i < refined; ++i)
+    result.push_back({ directions[order[i]], 0.0, 0, 0.0 });
+  result.push_back({ Vector3D(0.0, 0.0, 1.0), 0.0, 0, 0.0 });
+
+  n = result.size();
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long i = 0; i < n; ++i) {
+    auto &c = result[i];
+    const Vector3D &u = c.up;
+    double lowest = blocks.lowest(u);
+    for (size_t f = 0; f < n_faces; ++f) {
+      double nu = normals[f] | u;
+      if (areas[f] == 0 || nu > threshold)
+        continue;
+      c.overhang_area += areas[f];
+      c.volume -= areas[f] * nu * ((centroids[f] | u) - lowest);
+    }
+    std::vector<double> heights(n_points);
+    for (size_t v = 0; v < n_points; ++v)
+      heights[v] = points[v] | u;
+    for (size_t v = 0; v < n_points; ++v) {
+      if (offsets[v] == offsets[v+1])
+        continue;
+      bool minimum = true;
+      for (size_t j = offsets[v]; minimum && j < offsets[v+1]; ++j)
+        minimum = heights[neighbors[j]] > heights[v];
+      if (minimum) {
+        ++c.minima;
+        c.volume += column_area * (heights[v] - lowest);
+      }
+    }
+  }
+
+  std::sort(result.begin(), result.end(), [](const Candidate &a, const Candidate &b) {
+      if (a.volume != b.volume) return a.volume < b.volume;
+      return a.overhang_area < b.overhang_area;
+    });
+  return result;
+}
+
+Vector3D rotate(const Vector3D &up, const Vector3D &p) {
+  Vector3D u = up / up.norm(), axis = u % Vector3D(0.0, 0.0, 1.0);
+  double s = axis.norm(), c = u[2];
+  if (s < 1.0e-12)
+    return c > 0 ? p : Vector3D(p[0], -p[1], -p[2]); // identity, or a half turn around X
+  axis /= s;
+  return p * c + (axis % p) * s + axis * ((axis | p) * (1 - c));
+}
+
+}
@@ -0,0 +1,35 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <vector>
+
+#include <OpenMesh/Core/Geometry/VectorT.hh>
+
+namespace Orientation {
+
+using Vector3D = OpenMesh::VectorT<double,3>;
+using PointVector = std::vector<Vector3D>;
+
+struct Candidate {
+  Vector3D up;           // direction of the model that is turned upwards
+  double overhang_area;  // of the downward faces steeper than the angle limit
+  size_t minima;         // number of local minima of the height
+  double volume;         // estimated support volume
+};
+
+// Ranks print orientations by their estimated support volume: the space between the overhangs
+// and the plate, plus a column of cross-section `column_area` under each local minimum.
+//
+// `samples` directions are spread evenly on the sphere, and all of them are evaluated
+// in parallel on the faces grouped by their normals. The `refined` best ones, and the current
+// orientation (+Z), are then evaluated exactly, counting the minima as well.
+// These are returned, best first.
+// `triangles` holds three vertex indices per face
+std::vector<Candidate> rank(const PointVector &points, const std::vector<int> &triangles,
+                            double angle_limit, double column_area,
+                            size_t samples = 2000, size_t refined = 32);
+
+// Rotates p by the rotation taking `up` to +Z
+Vector3D rotate(const Vector3D &up, const Vector3D &p);
+
+}
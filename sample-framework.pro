@@ -2,24 +2,35 @@
 
 TARGET = sample-framework
 CONFIG += c++14 qt opengl debug
-QT += gui widgets opengl xml
+QT += gui widgets opengl xml concurrent
 equals (QT_MAJOR_VERSION, 6) {
     QT += openglwidgets
 }
 
 HEADERS = MyWindow.h MyViewer.h MyViewer.hpp
-SOURCES = MyWindow.cpp MyViewer.cpp main.cpp jet-wrapper.cpp
+SOURCES = MyWindow.cpp MyViewer.cpp main.cpp jet-wrapper.cpp offscreen-context.cpp implicit-fairing.cpp mesh-snapshot.cpp orientation.cpp height-field.cpp
 
 QMAKE_CXXFLAGS += -O3
 
+# Parallel loops
+unix:QMAKE_CXXFLAGS += -fopenmp
+unix:LIBS += -fopenmp
+win32:QMAKE_CXXFLAGS += -openmp
+
 unix:INCLUDEPATH += /usr/include/eigen3
 unix:LIBS *= -lQGLViewer-qt5 -lOpenMeshCore -lGL -lGLU
 
+# Headless rendering (--thumbnails) through EGL
+unix:DEFINES += USE_OFFSCREEN
+unix:LIBS *= -lEGL
+
 RESOURCES = sample-framework.qrc
 
 # Optional
 # DEFINES += BETTER_MEAN_CURVATURE
 # DEFINES += USE_JET_FITTING
+# DEFINES += SINGLE_PRECISION_MESH
+# unix:QMAKE_CXXFLAGS += -mavx2 # vectorized closest point queries
 # LIBS += -lCGAL # this library will be header-only from version 5
 
 ###########################